@@ -1,2 +1,12 @@
-void riecoin_init(uint64_t sieveMax, int numThreads);
-void riecoin_process(minerRiecoinBlock_t* block);
+// a block prepared ahead of time for searching
+typedef struct
+{
+	minerRiecoinBlock_t block;
+	mpz_t target;
+	struct rh_workUnit_s* searchUnit;
+}riecoinWorkUnit_t;
+
+void riecoin_init(uint64_t sieveMax, int numThreads, int numEngines, uint32 verifyShareInterval);
+riecoinWorkUnit_t* riecoin_createWorkUnit();
+bool riecoin_prepareWorkUnit(riecoinWorkUnit_t* workUnit);
+void riecoin_processWorkUnit(riecoinWorkUnit_t* workUnit, int engine);
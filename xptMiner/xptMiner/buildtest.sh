@@ -1,2 +1,2 @@
-g++ testharness.cpp riecoinMiner.o rh_riecoin.o sha2.o -o test -g -Wall -lpthread -le-hal -le-loader -L/opt/adapteva/esdk/tools/host/lib -lgmp
+g++ testharness.cpp riecoinMiner.o rh_riecoin.o rh_fermat.o rh_alloc.o rh_sched.o rh_numa.o rh_affinity.o rh_cancel.o rh_stats.o sha2.o -o test -g -Wall -lpthread -le-hal -le-loader -L/opt/adapteva/esdk/tools/host/lib -lgmp
 
@@ -142,7 +142,7 @@ typedef struct
 	uint64	nTime; // Riecoin has 64bit timestamps
 	uint8	nOffset[32];
 	// remaining data
-	uint32	uniqueMerkleSeed;
+	uint64	uniqueMerkleSeed; // the extra nonce
 	uint32	height;
 	uint8	merkleRootOriginal[32]; // used to identify work
 	// uint8	target[32];
@@ -155,15 +155,12 @@ typedef struct
 #include"algorithm.h"
 
 
-void xptMiner_submitShare(minerRiecoinBlock_t* block, uint8* nOffset);
+// isBlock puts the share in the priority lane, timeFound is from getTimeHighRes()
+void xptMiner_submitShare(minerRiecoinBlock_t* block, uint8* nOffset, bool isBlock, uint64 timeFound);
 
 // stats
 extern volatile uint32 totalCollisionCount;
-extern volatile uint32 totalShareCount;
-extern volatile uint32 totalRejectedShareCount;
-extern volatile uint32 total2ChainCount;
-extern volatile uint32 total3ChainCount;
-extern volatile uint32 total4ChainCount;
+// the rest are counted in rh_stats.h
 
 
 extern volatile uint32 monitorCurrentBlockHeight;
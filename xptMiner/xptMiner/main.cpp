@@ -1,10 +1,18 @@
 #include "global.h"
 #include "ticker.h"
+#include "tsqueue.hpp"
+#include "rh_riecoin.h"
+#include "rh_alloc.h"
+#include "rh_affinity.h"
+#include "rh_stats.h"
 #include <signal.h>
 #include <stdio.h>
 #include <cstring>
 #include <sys/time.h>
 #define MAX_TRANSACTIONS	(4096)
+#define WORK_QUEUE_SIZE		(2)		// number of prepared work units kept ready for the miner threads
+#define MAX_SHARDS		(32)	// miner threads, each searching its own work unit
+#define WORK_UNIT_MAX_AGE	(120)	// seconds before a prepared work unit is considered stale
 
 // miner version string (for pool statistic)
 char* minerVersionString = "xptMiner 1.7rh-epip2";
@@ -16,13 +24,6 @@ CRITICAL_SECTION cs_xptClient;
 volatile uint32 monitorCurrentBlockHeight; // used to notify worker threads of new block data
 volatile uint32 monitorCurrentBlockTime; // keeps track of current block time, used to detect if current work data is outdated
 
-// stats
-volatile uint32 totalShareCount = 0;
-volatile uint32 totalRejectedShareCount = 0;
-volatile uint32 total2ChainCount = 0;
-volatile uint32 total3ChainCount = 0;
-volatile uint32 total4ChainCount = 0;
-
 
 typedef struct  
 {
@@ -31,6 +32,7 @@ typedef struct
 	char* host;
 	sint32 port;
 	sint32 numThreads;
+	sint32 numShards;
 	uint32 ptsMemoryMode;
 	// GPU / OpenCL options
 	bool useGPU;
@@ -38,6 +40,7 @@ typedef struct
 	uint32 mode;
 	float donationPercent;
         uint32 sieveMax;
+	uint32 verifyShareInterval;
 }commandlineInput_t;
 
 commandlineInput_t commandlineInput;
@@ -63,31 +66,150 @@ struct
 	uint8	coinBase2[1024];
 	uint16	coinBase1Size;
 	uint16	coinBase2Size;
-	// transaction hashes
-	uint8	txHash[32*MAX_TRANSACTIONS];
+	sha256_ctx	coinBase1State; // hash state after coinBase1, the same for every extra nonce
+	// transaction hashes, after a slot for the coinbase, and the coinbase's
+	// merkle branch worked out from them, which is all a new extra nonce needs
+	uint8	txHash[32*(MAX_TRANSACTIONS+1)];
 	uint32	txHashCount;
+	uint8	merkleBranch[32*MAX_MERKLE_BRANCH];
+	uint32	merkleBranchLength;
 }workDataSource;
 
-uint32_t uniqueMerkleSeedGenerator;
+// the extra nonce in each work unit's coinbase is 8 bytes, of the 16 the
+// xpt share packet carries, split into 32 random bits picked for each run
+// of the miner, then the thread building the unit, then a count of the
+// units it has built.  Only the random part can collide: with n runs on
+// the same worker login at once, two share an instance with probability
+// about n*n/2^33 (under 1 in 10^6 for 100 runs).  The counter wraps after
+// 2^28 units per thread, which the duplicate target check covers.
+#define SEED_SOURCE_BITS	(4)
+#define SEED_COUNTER_BITS	(28)
+
+uint64 merkleSeedInstance;
+volatile uint32 numMerkleSeedSources = 0;
+__thread uint64 merkleSeedBase = 0;
+__thread uint64 merkleSeedCounter = 0;
 uint32 miningStartTime = 0;
 
+// prepared work units, and those available to be prepared
+ts_queue<riecoinWorkUnit_t*, WORK_QUEUE_SIZE> workQueue;
+ts_queue<riecoinWorkUnit_t*, WORK_QUEUE_SIZE+1+MAX_SHARDS> freeWorkUnits;
+
+
+// shares go to the network thread through a pair of rings for each thread
+// that finds them, blocks and shares, so submitting never takes a lock or
+// allocates.  Each thread is given its rings on its first share.
+#define SHARE_RING_SIZE		(16)
+#define MAX_SHARE_THREADS	(256)
+
+typedef struct
+{
+	ts_spsc_ring<xptShareToSubmit_t, SHARE_RING_SIZE> blocks;
+	ts_spsc_ring<xptShareToSubmit_t, SHARE_RING_SIZE> shares;
+}shareRings_t;
+
+// kept static so the rings are cache line aligned, and a ring is empty
+// before the thread claiming it has published anything to it
+shareRings_t shareRings[MAX_SHARE_THREADS];
+volatile uint32 numShareRings = 0;
+__thread shareRings_t* threadShareRings = NULL;
+
+// the network thread waits on this between polls of the connection,
+// and every share wakes it
+ts_event networkWake;
+
+bool xptMiner_sharesWaiting()
+{
+	uint32 n = __atomic_load_n(&numShareRings, __ATOMIC_RELAXED);
+	for(uint32 i=0; i<n; i++)
+	{
+		if( !shareRings[i].blocks.empty() || !shareRings[i].shares.empty() )
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Waits up to ms milliseconds, or until a share is submitted
+ */
+void xptMiner_waitForNetworkWork(uint32 ms)
+{
+	uint32 seen = networkWake.prepare();
+	if( xptMiner_sharesWaiting() )
+		networkWake.cancel();
+	else
+		networkWake.wait(seen, ms);
+}
+
+void xptMiner_wakeNetwork()
+{
+	networkWake.signal(1);
+}
+
+/*
+ * Sends everything in the share rings, block solutions first
+ * Only called by the network thread, under cs_xptClient
+ */
+void xptMiner_sendQueuedShares(xptClient_t* xptClient)
+{
+	bool connected = xptClient != NULL && xptClient_isDisconnected(xptClient, NULL) == false;
+	uint32 n = __atomic_load_n(&numShareRings, __ATOMIC_RELAXED);
+	for(uint32 pass=0; pass<2; pass++)
+	{
+		for(uint32 i=0; i<n; i++)
+		{
+			ts_spsc_ring<xptShareToSubmit_t, SHARE_RING_SIZE>* ring = pass == 0 ? &shareRings[i].blocks : &shareRings[i].shares;
+			xptShareToSubmit_t* xptShare;
+			while( (xptShare = ring->front_slot()) != NULL )
+			{
+				uint32 passedSeconds = (uint32)time(NULL) - miningStartTime;
+				printf("[%02d:%02d:%02d] %s found! (Blockheight: %d)\n", (passedSeconds/3600)%60, (passedSeconds/60)%60, (passedSeconds)%60, xptShare->isBlock ? "Block" : "Share", xptShare->height);
+				if( connected )
+				{
+					xptClient_sendShare(xptClient, xptShare);
+					if( xptShare->isBlock )
+					{
+						uint64 timeSent = getTimeHighRes();
+						printf("Block sent %.2fms after it was found (%.2fms queued)\n", xptClient_highResToMs(timeSent - xptShare->timeFound), xptClient_highResToMs(timeSent - xptShare->timeQueued));
+					}
+				}
+				else
+					printf("Share submission failed - No connection to server\n");
+				ring->pop_front_slot();
+			}
+		}
+	}
+}
 
 /*
  * Submit Riecoin share
+ * Block solutions are sent ahead of shares
  */
-void xptMiner_submitShare(minerRiecoinBlock_t* block, uint8* nOffset)
+void xptMiner_submitShare(minerRiecoinBlock_t* block, uint8* nOffset, bool isBlock, uint64 timeFound)
 {
-	uint32 passedSeconds = (uint32)time(NULL) - miningStartTime;
-	printf("[%02d:%02d:%02d] Share found! (Blockheight: %d)\n", (passedSeconds/3600)%60, (passedSeconds/60)%60, (passedSeconds)%60, block->height);
-	EnterCriticalSection(&cs_xptClient);
-	if( xptClient == NULL || xptClient_isDisconnected(xptClient, NULL) == true )
+	shareRings_t* rings = threadShareRings;
+	if( rings == NULL )
+	{
+		uint32 n = __atomic_load_n(&numShareRings, __ATOMIC_RELAXED);
+		do
+		{
+			if( n >= MAX_SHARE_THREADS )
+			{
+				printf("Share submission failed - Too many threads\n");
+				return;
+			}
+		} while( !__atomic_compare_exchange_n(&numShareRings, &n, n+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) );
+		rings = &shareRings[n];
+		threadShareRings = rings;
+	}
+	ts_spsc_ring<xptShareToSubmit_t, SHARE_RING_SIZE>* ring = isBlock ? &rings->blocks : &rings->shares;
+	xptShareToSubmit_t* xptShare = ring->back_slot();
+	if( xptShare == NULL )
 	{
-		printf("Share submission failed - No connection to server\n");
-		LeaveCriticalSection(&cs_xptClient);
+		printf("Share submission failed - Queue full\n");
+		xptMiner_wakeNetwork();
 		return;
 	}
-	// submit block
-	xptShareToSubmit_t* xptShare = (xptShareToSubmit_t*)malloc(sizeof(xptShareToSubmit_t));
 	memset(xptShare, 0x00, sizeof(xptShareToSubmit_t));
 	xptShare->algorithm = ALGORITHM_RIECOIN;
 	xptShare->version = block->version;
@@ -97,13 +219,154 @@ void xptMiner_submitShare(minerRiecoinBlock_t* block, uint8* nOffset)
 	memcpy(xptShare->prevBlockHash, block->prevBlockHash, 32);
 	memcpy(xptShare->merkleRoot, block->merkleRoot, 32);
 	memcpy(xptShare->merkleRootOriginal, block->merkleRootOriginal, 32);
-	sint32 userExtraNonceLength = sizeof(uint32);
+	sint32 userExtraNonceLength = sizeof(uint64);
 	uint8* userExtraNonceData = (uint8*)&block->uniqueMerkleSeed;
 	xptShare->userExtraNonceLength = userExtraNonceLength;
 	memcpy(xptShare->userExtraNonceData, userExtraNonceData, userExtraNonceLength);
 	memcpy(xptShare->riecoin_nOffset, nOffset, 32);
-	xptClient_foundShare(xptClient, xptShare);
-	LeaveCriticalSection(&cs_xptClient);
+	xptShare->isBlock = isBlock;
+	xptShare->timeFound = timeFound;
+	xptShare->timeQueued = getTimeHighRes();
+	xptShare->height = block->height;
+	ring->push_back_slot();
+	xptMiner_wakeNetwork();
+}
+
+/*
+ * Picks the random part of the extra nonce for this run of the miner
+ */
+void xptMiner_initMerkleSeed()
+{
+#ifdef _WIN32
+	uint64 x = getTimeHighRes() ^ ((uint64)GetCurrentProcessId() << 32);
+#else
+	uint64 x = getTimeHighRes() ^ ((uint64)getpid() << 32);
+	// prefer the system's entropy, as runs started by a script on many
+	// machines can have the same pid and nearly the same time
+	uint64 r = 0;
+	FILE* urandom = fopen("/dev/urandom", "rb");
+	if( urandom )
+	{
+		if( fread(&r, sizeof(r), 1, urandom) == 1 )
+			x ^= r;
+		fclose(urandom);
+	}
+#endif
+	// mix so that miners started together still differ in every bit
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	merkleSeedInstance = x >> (SEED_SOURCE_BITS+SEED_COUNTER_BITS);
+	if( merkleSeedInstance == 0 )
+		merkleSeedInstance = 1;
+}
+
+/*
+ * Returns the next extra nonce for a work unit built on the calling thread
+ */
+uint64 xptMiner_nextMerkleSeed()
+{
+	if( merkleSeedBase == 0 )
+	{
+		uint32 source = __atomic_fetch_add(&numMerkleSeedSources, 1, __ATOMIC_RELAXED);
+		if( source >= (1<<SEED_SOURCE_BITS) )
+		{
+			printf("Too many threads building work units\n");
+			exit(-1);
+		}
+		merkleSeedBase = (merkleSeedInstance << (SEED_SOURCE_BITS+SEED_COUNTER_BITS)) | ((uint64)source << SEED_COUNTER_BITS);
+	}
+	uint64 seed = merkleSeedBase | (merkleSeedCounter & ((1ull<<SEED_COUNTER_BITS)-1));
+	merkleSeedCounter++;
+	return seed;
+}
+
+/*
+ * Fills in the block data for a new work unit from the current work
+ * Returns false if there is no valid work
+ */
+bool xptMiner_getWorkUnitBlock(minerRiecoinBlock_t* minerRiecoinBlock)
+{
+	bool hasValidWork = false;
+	EnterCriticalSection(&workDataSource.cs_work);
+	if( workDataSource.height > 0 )
+	{
+		switch( workDataSource.algorithm )
+		{
+		case ALGORITHM_RIECOIN:
+			// get maxcoin work data
+			memset(minerRiecoinBlock, 0x00, sizeof(minerRiecoinBlock_t));
+			minerRiecoinBlock->version = workDataSource.version;
+			minerRiecoinBlock->nTime = (uint64)time(NULL) + (uint64)(sint64)(sint32)workDataSource.timeBias; // Riecoin uses 64bit timestamp
+			minerRiecoinBlock->nBits = workDataSource.nBits;
+			minerRiecoinBlock->targetCompact = workDataSource.targetCompact;
+			minerRiecoinBlock->shareTargetCompact = workDataSource.shareTargetCompact;
+
+			minerRiecoinBlock->height = workDataSource.height;
+			memcpy(minerRiecoinBlock->merkleRootOriginal, workDataSource.merkleRootOriginal, 32);
+			memcpy(minerRiecoinBlock->prevBlockHash, workDataSource.prevBlockHash, 32);
+			minerRiecoinBlock->uniqueMerkleSeed = xptMiner_nextMerkleSeed();
+			// generate merkle root transaction
+			uint8 coinbaseHash[32];
+			bitclient_generateTxHashFromState(&workDataSource.coinBase1State, sizeof(uint64), (uint8*)&minerRiecoinBlock->uniqueMerkleSeed, workDataSource.coinBase2Size, workDataSource.coinBase2, coinbaseHash, TX_MODE_DOUBLE_SHA256);
+			bitclient_calculateMerkleRootFromBranch(coinbaseHash, workDataSource.merkleBranch, workDataSource.merkleBranchLength, minerRiecoinBlock->merkleRoot, TX_MODE_DOUBLE_SHA256);
+			hasValidWork = true;
+			break;
+		default:
+			printf("xptMiner_getWorkUnitBlock(): Unknown algorithm\n");
+			break;
+		}
+	}
+	LeaveCriticalSection(&workDataSource.cs_work);
+	return hasValidWork;
+}
+
+/*
+ * Returns true if a prepared work unit is for an old block or has been waiting too long
+ */
+bool xptMiner_isWorkUnitStale(riecoinWorkUnit_t* workUnit)
+{
+	EnterCriticalSection(&workDataSource.cs_work);
+	uint64 currentTime = (uint64)time(NULL) + (uint64)(sint64)(sint32)workDataSource.timeBias;
+	bool isStale = workUnit->block.height != workDataSource.height || currentTime > workUnit->block.nTime + WORK_UNIT_MAX_AGE;
+	LeaveCriticalSection(&workDataSource.cs_work);
+	return isStale;
+}
+
+/*
+ * Keeps workQueue filled with work units for the current block that are ready to search,
+ * so the miner thread can start on the next one without any setup
+ */
+#ifdef _WIN32
+int xptMiner_workFactoryThread(int threadIndex)
+{
+#else
+void *xptMiner_workFactoryThread(void *)
+{
+#endif
+	while( true )
+	{
+		riecoinWorkUnit_t* workUnit = freeWorkUnits.pop_front();
+		// a target that was searched recently is skipped for the next seed
+		do
+		{
+			while( xptMiner_getWorkUnitBlock(&workUnit->block) == false )
+				Sleep(1);
+		}
+		while( riecoin_prepareWorkUnit(workUnit) == false );
+		workQueue.push_back(workUnit);
+	}
+	return 0;
+}
+
+/*
+ * Returns all prepared work units to the free list
+ */
+void xptMiner_flushWorkQueue()
+{
+	riecoinWorkUnit_t* workUnit;
+	while( workQueue.try_pop_front(workUnit) )
+		freeWorkUnits.push_back(workUnit);
 }
 
 #ifdef _WIN32
@@ -115,69 +378,30 @@ void *xptMiner_minerThread(void *arg)
 	int threadIndex = (intptr_t)arg;
 #endif
 
-	// local work data
-
-	minerRiecoinBlock_t minerRiecoinBlock; 
-
 	while( true )
 	{
-		// has work?
-		bool hasValidWork = false;
-		EnterCriticalSection(&workDataSource.cs_work);
-		if( workDataSource.height > 0 )
-		{
-			switch( workDataSource.algorithm )
-			{
-			case ALGORITHM_RIECOIN:
-				// get maxcoin work data
-				memset(&minerRiecoinBlock, 0x00, sizeof(minerRiecoinBlock));
-				minerRiecoinBlock.version = workDataSource.version;
-				minerRiecoinBlock.nTime = (uint64)time(NULL) + (uint64)(sint64)(sint32)workDataSource.timeBias; // Riecoin uses 64bit timestamp
-				minerRiecoinBlock.nBits = workDataSource.nBits;
-				minerRiecoinBlock.targetCompact = workDataSource.targetCompact;
-				minerRiecoinBlock.shareTargetCompact = workDataSource.shareTargetCompact;
-
-				minerRiecoinBlock.height = workDataSource.height;
-				memcpy(minerRiecoinBlock.merkleRootOriginal, workDataSource.merkleRootOriginal, 32);
-				memcpy(minerRiecoinBlock.prevBlockHash, workDataSource.prevBlockHash, 32);
-				minerRiecoinBlock.uniqueMerkleSeed = ++uniqueMerkleSeedGenerator;
-				// generate merkle root transaction
-				bitclient_generateTxHash(sizeof(uint32), (uint8*)&minerRiecoinBlock.uniqueMerkleSeed, workDataSource.coinBase1Size, workDataSource.coinBase1, workDataSource.coinBase2Size, workDataSource.coinBase2, workDataSource.txHash, TX_MODE_DOUBLE_SHA256);
-				bitclient_calculateMerkleRoot(workDataSource.txHash, workDataSource.txHashCount+1, minerRiecoinBlock.merkleRoot, TX_MODE_DOUBLE_SHA256);
-				hasValidWork = true;
-				break;
-			}
-		}
-		LeaveCriticalSection(&workDataSource.cs_work);
-		if( hasValidWork == false )
+		riecoinWorkUnit_t* workUnit = workQueue.pop_front();
+		if( xptMiner_isWorkUnitStale(workUnit) )
 		{
-			Sleep(1);
+			freeWorkUnits.push_back(workUnit);
 			continue;
 		}
 		// valid work data present, start processing workload
-
-		if( workDataSource.algorithm == ALGORITHM_RIECOIN )
-		{
 #define DEBUG_TIMING 0
 #if DEBUG_TIMING
-		  struct timeval tv_start, tv_end;
-		  gettimeofday(&tv_start, NULL);
+		struct timeval tv_start, tv_end;
+		gettimeofday(&tv_start, NULL);
 #endif
-			riecoin_process(&minerRiecoinBlock);
+		riecoin_processWorkUnit(workUnit, threadIndex);
 #if DEBUG_TIMING
-		  gettimeofday(&tv_end, NULL);
-		  double d = (double)tv_end.tv_sec;
-		  d += ((double)tv_end.tv_usec)/1000000.0;
-		  d -= tv_start.tv_sec;
-		  d -= ((double)tv_start.tv_usec)/1000000.0;
-		  printf("riecoin loop %.2f seconds\n", d);
+		gettimeofday(&tv_end, NULL);
+		double d = (double)tv_end.tv_sec;
+		d += ((double)tv_end.tv_usec)/1000000.0;
+		d -= tv_start.tv_sec;
+		d -= ((double)tv_start.tv_usec)/1000000.0;
+		printf("riecoin loop %.2f seconds\n", d);
 #endif
-		}
-		else
-		{
-			printf("xptMiner_minerThread(): Unknown algorithm\n");
-			Sleep(5000); // dont spam the console
-		}
+		freeWorkUnits.push_back(workUnit);
 	}
 	return 0;
 }
@@ -194,7 +418,9 @@ void xptMiner_getWorkFromXPTConnection(xptClient_t* xptClient)
 	{
 		if( xptClient->algorithm == ALGORITHM_RIECOIN && algorithmInited[xptClient->algorithm] == 0 )
 		{
-		  riecoin_init(commandlineInput.sieveMax, commandlineInput.numThreads);
+		  riecoin_init(commandlineInput.sieveMax, commandlineInput.numThreads, commandlineInput.numShards, commandlineInput.verifyShareInterval);
+			// this is the network thread, placed now the engine has planned where its threads go
+			rh_affinityPin(RH_THREAD_NETWORK, 0);
 			algorithmInited[xptClient->algorithm] = 1;
 		}
 	}
@@ -212,6 +438,7 @@ void xptMiner_getWorkFromXPTConnection(xptClient_t* xptClient)
 	workDataSource.coinBase2Size = xptClient->blockWorkInfo.coinBase2Size;
 	memcpy(workDataSource.coinBase1, xptClient->blockWorkInfo.coinBase1, xptClient->blockWorkInfo.coinBase1Size);
 	memcpy(workDataSource.coinBase2, xptClient->blockWorkInfo.coinBase2, xptClient->blockWorkInfo.coinBase2Size);
+	bitclient_prepareCoinBase(&workDataSource.coinBase1State, workDataSource.coinBase1Size, workDataSource.coinBase1);
 
 	// get hashes
 	if( xptClient->blockWorkInfo.txHashCount > MAX_TRANSACTIONS )
@@ -221,18 +448,25 @@ void xptMiner_getWorkFromXPTConnection(xptClient_t* xptClient)
 	}
 	else
 		workDataSource.txHashCount = xptClient->blockWorkInfo.txHashCount;
-	for(uint32 i=0; i<xptClient->blockWorkInfo.txHashCount; i++)
+	for(uint32 i=0; i<workDataSource.txHashCount; i++)
 		memcpy(workDataSource.txHash+32*(i+1), xptClient->blockWorkInfo.txHashes+32*i, 32);
+	workDataSource.merkleBranchLength = bitclient_calculateMerkleBranch(workDataSource.txHash, workDataSource.txHashCount+1, workDataSource.merkleBranch, TX_MODE_DOUBLE_SHA256);
 	// set blockheight last since it triggers reload of work
 	if( workDataSource.height == 0 && xptClient->blockWorkInfo.height != 0 )
 	{
 		miningStartTime = (uint32)time(NULL);
 		printf("[00:00:00] Start mining\n");
 	}
+	bool isNewBlock = workDataSource.height != xptClient->blockWorkInfo.height;
 	workDataSource.height = xptClient->blockWorkInfo.height;
 	LeaveCriticalSection(&workDataSource.cs_work);
-	monitorCurrentBlockHeight = workDataSource.height;
-        __sync_synchronize(); /* memory barrier needed if this isn't done in crit */
+	__atomic_store_n(&monitorCurrentBlockHeight, workDataSource.height, __ATOMIC_RELEASE);
+	// work units prepared for the old block are useless now, and so are the searches
+	if( isNewBlock )
+	{
+		xptMiner_flushWorkQueue();
+		rh_cancelSearches();
+	}
 }
 
 #define getFeeFromDouble(_x) ((uint16)((double)(_x)/0.002)) // integer 1 = 0.002%
@@ -254,6 +488,9 @@ void xptMiner_xptQueryWorkLoop()
 	// init xpt connection object once
 	xptClient = xptMiner_initateNewXptConnectionObject();
 	uint32 timerPrintDetails = getTimeMilliseconds() + 8000;
+	rh_stageStats_t lastStageStats[TUPLE_MEMBERS] = {};
+	rh_nodeStats_t lastNodeStats[RH_NUMA_MAX_NODES] = {};
+	uint32 lastNodeStatsTick = getTimeMilliseconds();
 
 
        if(minerSettings.requestTarget.donationPercent > 0.1f)
@@ -281,11 +518,63 @@ void xptMiner_xptQueryWorkLoop()
 
 					if( passedSeconds > 5 )
 					{
-						speedRate_2ch = (double)total2ChainCount * 60.0 / (double)passedSeconds;
-						speedRate_3ch = (double)total3ChainCount * 60.0 / (double)passedSeconds;
-						speedRate_4ch = (double)total4ChainCount * 60.0 / (double)passedSeconds;
+						speedRate_2ch = (double)rh_statsGet(RH_STAT_2CH) * 60.0 / (double)passedSeconds;
+						speedRate_3ch = (double)rh_statsGet(RH_STAT_3CH) * 60.0 / (double)passedSeconds;
+						speedRate_4ch = (double)rh_statsGet(RH_STAT_4CH) * 60.0 / (double)passedSeconds;
+					}
+					uint64_t totalShareCount = rh_statsGet(RH_STAT_SHARES);
+					uint64_t totalRejectedShareCount = rh_statsGet(RH_STAT_REJECTED);
+					printf("[%02d:%02d:%02d] 2ch/m: %.4lf 3ch/m: %.4lf 4ch/m: %.4lf Shares total: %llu / %llu\n", (passedSeconds/3600)%100, (passedSeconds/60)%60, (passedSeconds)%60, speedRate_2ch, speedRate_3ch, speedRate_4ch, (unsigned long long)totalShareCount, (unsigned long long)(totalShareCount-totalRejectedShareCount));
+					uint64_t duplicateTargets = rh_statsGet(RH_STAT_DUPLICATE_TARGETS);
+					if( duplicateTargets > 0 )
+						printf("[%02d:%02d:%02d] Duplicate targets skipped: %llu\n", (passedSeconds/3600)%100, (passedSeconds/60)%60, (passedSeconds)%60, (unsigned long long)duplicateTargets);
+					// tuple testing funnel since the last print: queued candidates and pass rate per stage
+					rh_stageStats_t stageStats[TUPLE_MEMBERS];
+					rh_getStageStats(stageStats);
+					printf("[%02d:%02d:%02d] Tuple tests:", (passedSeconds/3600)%100, (passedSeconds/60)%60, (passedSeconds)%60);
+					for(uint32 m=0; m<TUPLE_MEMBERS; m++)
+					{
+						uint64 tested = stageStats[m].tested - lastStageStats[m].tested;
+						uint64 passed = stageStats[m].passed - lastStageStats[m].passed;
+						printf(" +%u: %uq %.2lf%%", stageStats[m].offset, stageStats[m].queued, tested ? (double)passed * 100.0 / (double)tested : 0.0);
+					}
+					printf("\n");
+					memcpy(lastStageStats, stageStats, sizeof(lastStageStats));
+					// candidates tested per second by the threads on each NUMA node
+					rh_nodeStats_t nodeStats[RH_NUMA_MAX_NODES];
+					uint32 numNodes = rh_getNodeStats(nodeStats);
+					if( numNodes > 1 && currentTick > lastNodeStatsTick )
+					{
+						double seconds = (double)(currentTick - lastNodeStatsTick) / 1000.0;
+						printf("[%02d:%02d:%02d] Nodes:", (passedSeconds/3600)%100, (passedSeconds/60)%60, (passedSeconds)%60);
+						for(uint32 n=0; n<numNodes; n++)
+							printf(" %u: %.1lfk/s (%u threads)", n, (double)(nodeStats[n].candidates - lastNodeStats[n].candidates) / seconds / 1000.0, nodeStats[n].workers);
+						printf("\n");
+					}
+					memcpy(lastNodeStats, nodeStats, sizeof(lastNodeStats));
+					lastNodeStatsTick = currentTick;
+					uint64_t totalVerifiedCount = rh_statsGet(RH_STAT_VERIFIED);
+					uint64_t totalVerifyRejectedCount = rh_statsGet(RH_STAT_VERIFY_REJECTED);
+					if( totalVerifiedCount + totalVerifyRejectedCount > 0 )
+						printf("[%02d:%02d:%02d] Verified tuples: %llu / %llu\n", (passedSeconds/3600)%100, (passedSeconds/60)%60, (passedSeconds)%60, (unsigned long long)totalVerifiedCount, (unsigned long long)(totalVerifiedCount+totalVerifyRejectedCount));
+					// how long searches took to stop after a new block, as bucket upper bounds
+					uint64_t abortLatency[RH_ABORT_BUCKETS];
+					uint64_t aborts = 0;
+					rh_getAbortLatency(abortLatency);
+					for(uint32 b=0; b<RH_ABORT_BUCKETS; b++)
+						aborts += abortLatency[b];
+					if( aborts > 0 )
+					{
+						uint32 p50 = 0, p99 = 0;
+						uint64_t seen = 0;
+						for(uint32 b=0; b<RH_ABORT_BUCKETS; b++)
+						{
+							seen += abortLatency[b];
+							if( seen * 2 < aborts ) p50 = b + 1;
+							if( seen * 100 < aborts * 99 ) p99 = b + 1;
+						}
+						printf("[%02d:%02d:%02d] Search aborts: %llu  p50 < %.3lfms  p99 < %.3lfms\n", (passedSeconds/3600)%100, (passedSeconds/60)%60, (passedSeconds)%60, (unsigned long long)aborts, (double)(1ull << p50) / 1000.0, (double)(1ull << p99) / 1000.0);
 					}
-					printf("[%02d:%02d:%02d] 2ch/m: %.4lf 3ch/m: %.4lf 4ch/m: %.4lf Shares total: %d / %d\n", (passedSeconds/3600)%100, (passedSeconds/60)%60, (passedSeconds)%60, speedRate_2ch, speedRate_3ch, speedRate_4ch, totalShareCount, totalShareCount-totalRejectedShareCount);
 					fflush(stdout);
 				}
 
@@ -296,14 +585,16 @@ void xptMiner_xptQueryWorkLoop()
 		if( xptClient_isDisconnected(xptClient, NULL) == false )
 		{
 			EnterCriticalSection(&cs_xptClient);
+			xptMiner_sendQueuedShares(xptClient);
 			xptClient_process(xptClient);
 			if( xptClient->disconnected )
 			{
 				// mark work as invalid
 				EnterCriticalSection(&workDataSource.cs_work);
 				workDataSource.height = 0;
-				monitorCurrentBlockHeight = 0;
+				__atomic_store_n(&monitorCurrentBlockHeight, 0, __ATOMIC_RELEASE);
 				LeaveCriticalSection(&workDataSource.cs_work);
+				rh_cancelSearches();
 				// we lost connection :(
 				printf("Connection to server lost - Reconnect in 45 seconds\n");
 				xptClient_forceDisconnect(xptClient);
@@ -337,13 +628,14 @@ void xptMiner_xptQueryWorkLoop()
 				// update time monitor
 				if( workDataSource.height > 0 )
 					monitorCurrentBlockTime = (uint32)time(NULL) + workDataSource.timeBias;
-				Sleep(1);
+				xptMiner_waitForNetworkWork(1);
 			}
 		}
 		else
 		{
-			// initiate new connection
+			// initiate new connection, dropping shares found while there was none
 			EnterCriticalSection(&cs_xptClient);
+			xptMiner_sendQueuedShares(xptClient);
 			xptClient = xptMiner_initateNewXptConnectionObject();
 
 	if(minerSettings.requestTarget.donationPercent > 0.1f)
@@ -367,9 +659,9 @@ void xptMiner_xptQueryWorkLoop()
 			{
 				LeaveCriticalSection(&cs_xptClient);
 				printf("Connected to server using x.pushthrough(xpt) protocol\n");
-				total2ChainCount = 0;
-				total3ChainCount = 0;
-				total4ChainCount = 0;
+				rh_statsReset(RH_STAT_2CH);
+				rh_statsReset(RH_STAT_3CH);
+				rh_statsReset(RH_STAT_4CH);
 			}
 			Sleep(1);
 		}
@@ -385,9 +677,16 @@ void xptMiner_printHelp()
 	puts("                                 You can specify a port after the url using -o url:port");
 	puts("   -u                            The username (workername) used for login");
 	puts("   -p                            The password used for login");
-	puts("   -t <num>                      The number of threads for mining (default is set to number of cores)");
+	puts("   -t <num>                      The number of Fermat test threads (default is set to number of cores)");
 	puts("                                 For most efficient mining, set to number of virtual cores if you have memory");
+	puts("   -shards <num>                 Search this many work units at once, splitting the test threads");
+	puts("                                 between them (default: 1). On NUMA systems each goes on its own node");
 	puts("   -s <num>                      Prime sieve max (default: 900000000)");
+	puts("   -v <num>                      Verify one in this many shares before submitting, 0 for none (default: 16)");
+	puts("                                 Blocks are always verified, on the thread that found them");
+	puts("   -affinity <mode>              Thread placement: none (default), auto to pin testers to separate");
+	puts("                                 physical cores and the network thread away from them,");
+	puts("                                 or a list of cpus for the test threads, e.g. 0,2,4,6");
 	puts("Example usage:");
 	puts("   xptMiner.exe -o http://poolurl.com:10034 -u workername.ric_1 -p workerpass -t 4");
 }
@@ -397,6 +696,7 @@ void xptMiner_parseCommandline(int argc, char **argv)
 	sint32 cIdx = 1;
 	commandlineInput.donationPercent = 2.0f;
 	commandlineInput.sieveMax = 900000000;
+	commandlineInput.verifyShareInterval = 16;
 
 	while( cIdx < argc )
 	{
@@ -473,6 +773,48 @@ void xptMiner_parseCommandline(int argc, char **argv)
 			}
 			cIdx++;
 		}
+		else if( memcmp(argument, "-shards", 8)==0 )
+		{
+			// -shards
+			if( cIdx >= argc )
+			{
+				printf("Missing number after -shards option\n");
+				exit(0);
+			}
+			commandlineInput.numShards = atoi(argv[cIdx]);
+			if( commandlineInput.numShards < 1 || commandlineInput.numShards > MAX_SHARDS )
+			{
+				printf("-shards parameter out of range");
+				exit(0);
+			}
+			cIdx++;
+		}
+		else if( memcmp(argument, "-affinity", 10)==0 )
+		{
+			// -affinity
+			if( cIdx >= argc )
+			{
+				printf("Missing mode after -affinity option\n");
+				exit(0);
+			}
+			if( rh_affinitySet(argv[cIdx]) == 0 )
+			{
+				printf("-affinity must be none, auto or a list of cpus");
+				exit(0);
+			}
+			cIdx++;
+		}
+		else if( memcmp(argument, "-v", 3)==0 )
+		{
+			// -v
+			if( cIdx >= argc )
+			{
+				printf("Missing share interval after -v option\n");
+				exit(0);
+			}
+			commandlineInput.verifyShareInterval = atoi(argv[cIdx]);
+			cIdx++;
+		}
 		else if( memcmp(argument, "-gpu", 5)==0 )
 		{
 			commandlineInput.useGPU = true;
@@ -514,9 +856,12 @@ void xptMiner_parseCommandline(int argc, char **argv)
 
 int main(int argc, char** argv)
 {
+	// GMP must use the arenas from the first allocation
+	rh_allocInit();
 
 	commandlineInput.host = "ypool.net";
 	srand(getTimeMilliseconds());
+	xptMiner_initMerkleSeed();
 	commandlineInput.port = 8080 + (rand()%8); // use random port between 8080 and 8087
 	commandlineInput.useGPU = false;
   uint32_t numcpu = 1; // in case we fall through;	
@@ -554,8 +899,8 @@ sysctl(mib, 2, &numcpu, &len, NULL, 0);
 #endif
 
 	commandlineInput.numThreads = numcpu;
+	commandlineInput.numShards = 1;
 	xptMiner_parseCommandline(argc, argv);
-	commandlineInput.numThreads = 0;
 	minerSettings.useGPU = commandlineInput.useGPU;
 	printf("----------------------------\n");
 	printf("  xptMiner/ric/rh (%s)\n", minerVersionString);
@@ -563,7 +908,6 @@ sysctl(mib, 2, &numcpu, &len, NULL, 0);
 	printf("  http://ypool.net\n");
 	printf("----------------------------\n");
 	printf("Launching miner...\n");
-	commandlineInput.numThreads += 1;
 
 	if( commandlineInput.useGPU ) {
 		printf("Using GPU if possible\n");
@@ -605,7 +949,6 @@ sysctl(mib, 2, &numcpu, &len, NULL, 0);
 	// start miner threads
 #ifndef _WIN32
 	
-	pthread_t threads[commandlineInput.numThreads];
 	pthread_attr_t threadAttr;
 	pthread_attr_init(&threadAttr);
 	// Set the stack size of the thread
@@ -613,12 +956,24 @@ sysctl(mib, 2, &numcpu, &len, NULL, 0);
 	// free resources of thread upon return
 	pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
 #endif
-	printf("Launching the %d threads\n", commandlineInput.numThreads);
-	for(uint32 i=0; i<commandlineInput.numThreads; i++)
+	for(sint32 i=0; i<WORK_QUEUE_SIZE+1+commandlineInput.numShards; i++)
+		freeWorkUnits.push_back(riecoin_createWorkUnit());
+	// each engine runs one search at a time and spreads it over its own tester threads
+	for(sint32 i=0; i<commandlineInput.numShards; i++)
+	{
+#ifdef _WIN32
+		CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)xptMiner_minerThread, (LPVOID)(intptr_t)i, 0, NULL);
+#else
+		pthread_t minerThread;
+		pthread_create(&minerThread, &threadAttr, xptMiner_minerThread, (void *)(intptr_t)i);
+#endif
+	}
+	// start work unit factory
 #ifdef _WIN32
-		CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)xptMiner_minerThread, (LPVOID)0, 0, NULL);
+	CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)xptMiner_workFactoryThread, (LPVOID)0, 0, NULL);
 #else
-		pthread_create(&threads[i], &threadAttr, xptMiner_minerThread, (void *)i);
+	pthread_t workFactoryThread;
+	pthread_create(&workFactoryThread, &threadAttr, xptMiner_workFactoryThread, NULL);
 #endif
 	// enter work management loop
 	xptMiner_xptQueryWorkLoop();
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include "rh_affinity.h"
+#include "rh_numa.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SMT 8
+
+typedef struct
+{
+  unsigned node, llc, package, coreId; // Sort order
+  unsigned threads;
+  int cpu[MAX_SMT];
+  unsigned testers; // Testers placed on this core
+  unsigned others;  // Search threads placed on this core
+} core_t;
+
+static enum { PLACE_NONE, PLACE_AUTO, PLACE_LIST } mode = PLACE_NONE;
+static int* listCpus;
+static unsigned numListCpus;
+
+static core_t* cores;
+static unsigned numCores;
+static int* testerCpu;
+static unsigned numTesterCpus;
+static int* searchCpu; // One for each engine
+static unsigned numSearchCpus;
+static int networkCpu = -1;
+
+int rh_affinitySet(const char* spec)
+{
+  if (strcmp(spec, "none") == 0)
+  {
+    mode = PLACE_NONE;
+    return 1;
+  }
+  if (strcmp(spec, "auto") == 0)
+  {
+    mode = PLACE_AUTO;
+    return 1;
+  }
+
+  unsigned n = 1;
+  for (const char* c = spec; *c; ++c)
+  {
+    if (*c == ',') ++n;
+    else if (*c < '0' || *c > '9') return 0;
+  }
+  listCpus = malloc(sizeof(int) * n);
+  numListCpus = 0;
+  for (const char* c = spec; *c; )
+  {
+    if (*c == ',') return 0;
+    listCpus[numListCpus++] = strtoul(c, (char**)&c, 10);
+    if (*c == ',' && *++c == 0) return 0;
+  }
+  if (numListCpus == 0) return 0;
+  mode = PLACE_LIST;
+  return 1;
+}
+
+static int readUint(const char* path, unsigned* value)
+{
+  FILE* f = fopen(path, "r");
+  if (!f) return 0;
+  int ok = fscanf(f, "%u", value) == 1;
+  fclose(f);
+  return ok;
+}
+
+// Identifies the largest cache cpu is on by the first CPU sharing it
+static unsigned lastLevelCache(unsigned cpu)
+{
+  unsigned llc = cpu, bestLevel = 0;
+  for (unsigned index = 0; index < 10; ++index)
+  {
+    char path[96];
+    unsigned level, first;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/level", cpu, index);
+    if (!readUint(path, &level)) break;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list", cpu, index);
+    if (level > bestLevel && readUint(path, &first))
+    {
+      bestLevel = level;
+      llc = first;
+    }
+  }
+  return llc;
+}
+
+static int compareCores(const void* va, const void* vb)
+{
+  const core_t* a = va;
+  const core_t* b = vb;
+  if (a->node != b->node) return a->node < b->node ? -1 : 1;
+  if (a->llc != b->llc) return a->llc < b->llc ? -1 : 1;
+  if (a->package != b->package) return a->package < b->package ? -1 : 1;
+  if (a->coreId != b->coreId) return a->coreId < b->coreId ? -1 : 1;
+  return 0;
+}
+
+// Groups the online CPUs into physical cores
+static void readTopology()
+{
+  long maxCpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (maxCpus < 1) maxCpus = 1;
+  cores = calloc(maxCpus, sizeof(core_t));
+  numCores = 0;
+
+  for (unsigned cpu = 0; cpu < maxCpus; ++cpu)
+  {
+    char path[96];
+    unsigned online = 1, package = 0, coreId = cpu;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/online", cpu);
+    readUint(path, &online);
+    if (!online) continue;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+    readUint(path, &package);
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+    if (!readUint(path, &coreId) && cpu > 0) continue;
+
+    unsigned c;
+    for (c = 0; c < numCores; ++c)
+      if (cores[c].package == package && cores[c].coreId == coreId) break;
+    if (c == numCores)
+    {
+      cores[c].node = rh_numaNodeOfCpu(cpu);
+      cores[c].llc = lastLevelCache(cpu);
+      cores[c].package = package;
+      cores[c].coreId = coreId;
+      ++numCores;
+    }
+    if (cores[c].threads < MAX_SMT)
+      cores[c].cpu[cores[c].threads++] = cpu;
+  }
+
+  qsort(cores, numCores, sizeof(core_t), compareCores);
+}
+
+// First core with no threads on it, from the front or the back
+static int freeCore(int fromBack)
+{
+  for (unsigned i = 0; i < numCores; ++i)
+  {
+    unsigned c = fromBack ? numCores - 1 - i : i;
+    if (cores[c].testers == 0 && cores[c].others == 0) return c;
+  }
+  return -1;
+}
+
+// A CPU on core with no thread on it yet, or -1
+static int spareCpu(core_t* core)
+{
+  if (core->threads <= core->testers + core->others) return -1;
+  return core->cpu[core->threads - 1 - core->others];
+}
+
+static void printCpus(const char* name, const int* cpus, unsigned count)
+{
+  printf("  %s:", name);
+  for (unsigned i = 0; i < count; ++i)
+    printf(cpus[i] < 0 ? " -" : " %d", cpus[i]);
+  printf("\n");
+}
+
+void rh_affinityPlan(unsigned testers, const unsigned* testerNode, unsigned engines, const unsigned* engineFirstTester)
+{
+  if (mode != PLACE_AUTO) return;
+
+  readTopology();
+  if (numCores == 0)
+  {
+    printf("Affinity: no CPU topology, threads are not pinned\n");
+    mode = PLACE_NONE;
+    return;
+  }
+
+  // Cores are sorted by node then cache, so each node's cores are a run
+  // and consecutive cores share a last level cache where they can.
+  unsigned nodeFirst[RH_NUMA_MAX_NODES], nodeCount[RH_NUMA_MAX_NODES], nodeNext[RH_NUMA_MAX_NODES];
+  for (unsigned n = 0; n < RH_NUMA_MAX_NODES; ++n)
+  {
+    nodeFirst[n] = numCores;
+    nodeCount[n] = 0;
+    nodeNext[n] = 0;
+  }
+  for (unsigned c = 0; c < numCores; ++c)
+  {
+    unsigned n = cores[c].node;
+    if (n >= RH_NUMA_MAX_NODES) continue;
+    if (nodeFirst[n] == numCores) nodeFirst[n] = c;
+    nodeCount[n]++;
+  }
+
+  // One tester per physical core of its node, going on to the SMT
+  // siblings when there are more testers than cores
+  testerCpu = malloc(sizeof(int) * testers);
+  unsigned* testerCore = malloc(sizeof(unsigned) * testers);
+  numTesterCpus = testers;
+  for (unsigned i = 0; i < testers; ++i)
+  {
+    unsigned n = testerNode[i] < RH_NUMA_MAX_NODES ? testerNode[i] : 0;
+    unsigned k = nodeNext[n]++;
+    unsigned first = nodeFirst[n], count = nodeCount[n];
+    if (count == 0)
+    {
+      first = 0;
+      count = numCores;
+    }
+    testerCore[i] = first + k % count;
+    core_t* core = &cores[testerCore[i]];
+    testerCpu[i] = core->cpu[(k / count) % core->threads];
+    core->testers++;
+  }
+
+  // A search thread spends most of its time waiting for the Epiphany, so
+  // it shares its engine's first tester's core, on a free SMT sibling if
+  // any.  Otherwise it takes a free core, or shares the tester's CPU.
+  searchCpu = malloc(sizeof(int) * engines);
+  numSearchCpus = engines;
+  for (unsigned e = 0; e < engines; ++e)
+  {
+    unsigned tester = engineFirstTester[e] < testers ? engineFirstTester[e] : 0;
+    core_t* core = &cores[testerCore[tester]];
+    int c;
+    if ((searchCpu[e] = spareCpu(core)) >= 0)
+    {
+      core->others++;
+    }
+    else if ((c = freeCore(0)) >= 0)
+    {
+      searchCpu[e] = cores[c].cpu[0];
+      cores[c].others++;
+    }
+    else
+    {
+      searchCpu[e] = testerCpu[tester];
+    }
+  }
+  free(testerCore);
+
+  // The network thread goes as far from the others as it can, and is
+  // left unpinned if every CPU has a thread.
+  int c = freeCore(1);
+  if (c >= 0)
+    networkCpu = cores[c].cpu[0];
+  else
+    networkCpu = spareCpu(&cores[numCores - 1]);
+
+  printf("Affinity: %u cores, %u cpus\n", numCores, (unsigned)sysconf(_SC_NPROCESSORS_ONLN));
+  printCpus("testers", testerCpu, testers);
+  printCpus("search", searchCpu, engines);
+  printCpus("network", &networkCpu, 1);
+}
+
+static void pinTo(int cpu)
+{
+  if (cpu < 0) return;
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0)
+    printf("Affinity: Failed to pin thread to cpu %d\n", cpu);
+}
+
+void rh_affinityPin(rh_threadRole_t role, unsigned index)
+{
+  if (mode == PLACE_LIST)
+  {
+    if (role == RH_THREAD_TESTER)
+      pinTo(listCpus[index % numListCpus]);
+  }
+  else if (mode == PLACE_AUTO && testerCpu)
+  {
+    if (role == RH_THREAD_TESTER)
+      pinTo(testerCpu[index % numTesterCpus]);
+    else if (role == RH_THREAD_SEARCH)
+      pinTo(searchCpu[index % numSearchCpus]);
+    else
+      pinTo(networkCpu);
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Thread placement.  "none" leaves threads to the scheduler (bound only
+// to their NUMA node).  "auto" reads cores, SMT siblings and shared
+// caches from /sys/devices/system/cpu: testers get a physical core each,
+// with neighbouring testers sharing a last level cache, each engine's
+// search thread shares its first tester's core, and the network thread
+// goes on a core with no tester if there is one.  A CPU list like "0,2,4,6" pins
+// tester i to the i'th CPU and leaves the other threads alone.
+
+typedef enum
+{
+  RH_THREAD_TESTER,
+  RH_THREAD_SEARCH,  // Drives the sieve and the Epiphany
+  RH_THREAD_NETWORK
+} rh_threadRole_t;
+
+// Returns 0 if spec isn't understood.  Call before rh_oneTimeInit.
+int rh_affinitySet(const char* spec);
+
+// Works out where each thread goes, for this many testers numbered
+// across all the engines, tester i on node testerNode[i], and engine e's
+// testers starting at engineFirstTester[e]
+void rh_affinityPlan(unsigned testers, const unsigned* testerNode,
+                     unsigned engines, const unsigned* engineFirstTester);
+
+// Pins the calling thread, index is the tester number or the engine
+// number for a search thread
+void rh_affinityPin(rh_threadRole_t role, unsigned index);
+
+#ifdef __cplusplus
+}
+#endif
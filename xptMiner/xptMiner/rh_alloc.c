@@ -0,0 +1,208 @@
+#include "rh_alloc.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// GMP memory comes from per-thread arenas.  Blocks are bump allocated from
+// large chunks and recycled through power of two free lists, so after the
+// first unit each thread reuses the same memory and never calls malloc.
+// GMP's hooks are process wide, so each call finds the thread's arena
+// through thread local storage.  A block freed by a thread that doesn't
+// own it is pushed onto its owner's remote list, and picked up by the
+// owner next time a free list runs dry.  Arenas outlive their threads:
+// when a thread exits its arena goes back in a pool for the next thread.
+
+#define ARENA_CHUNK_SIZE (256*1024)
+#define ARENA_MIN_SHIFT 5
+#define ARENA_MAX_SHIFT 16
+#define ARENA_CLASSES (ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+
+typedef struct arena_s arena_t;
+
+// Precedes each block.  It's two words, so blocks cut from malloc'd memory
+// keep malloc's alignment, which is enough for GMP's limbs: 16 bytes on
+// LP64, but only 8 on a 32 bit ARM such as the Parallella's.
+typedef struct
+{
+  arena_t* arena; // NULL for large blocks straight from malloc
+  size_t size;    // Usable size
+} blockHeader_t;
+
+struct arena_s
+{
+  void* freeList[ARENA_CLASSES]; // Linked through the first word of the payload
+  char* bump;
+  char* bumpEnd;
+  void* remote;                  // Blocks freed by other threads
+  uint64_t allocs;
+  uint64_t heapAllocs;
+  arena_t* nextIdle;
+  arena_t* next;
+};
+
+static __thread arena_t* threadArena;
+static pthread_key_t arenaKey;
+static pthread_mutex_t arenaLock = PTHREAD_MUTEX_INITIALIZER;
+static arena_t* idleArenas;
+static arena_t* allArenas;
+
+static void releaseArena(void* p)
+{
+  arena_t* a = p;
+  pthread_mutex_lock(&arenaLock);
+  a->nextIdle = idleArenas;
+  idleArenas = a;
+  pthread_mutex_unlock(&arenaLock);
+}
+
+static arena_t* getArena()
+{
+  arena_t* a = threadArena;
+  if (a) return a;
+
+  pthread_mutex_lock(&arenaLock);
+  a = idleArenas;
+  if (a)
+  {
+    idleArenas = a->nextIdle;
+  }
+  else
+  {
+    a = calloc(1, sizeof(arena_t));
+    if (!a)
+    {
+      printf("Out of memory creating allocation arena\n");
+      exit(-1);
+    }
+    a->next = allArenas;
+    allArenas = a;
+  }
+  pthread_mutex_unlock(&arenaLock);
+
+  threadArena = a;
+  pthread_setspecific(arenaKey, a);
+  return a;
+}
+
+static void* heapAlloc(arena_t* a, size_t size)
+{
+  __atomic_store_n(&a->heapAllocs, a->heapAllocs + 1, __ATOMIC_RELAXED);
+  void* p = malloc(size);
+  if (!p)
+  {
+    printf("Out of memory allocating %u bytes\n", (unsigned)size);
+    exit(-1);
+  }
+  return p;
+}
+
+// Moves blocks other threads have freed onto the free lists
+static void collectRemote(arena_t* a)
+{
+  void* p = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+  while (p)
+  {
+    void* next = *(void**)p;
+    unsigned cls = __builtin_ctzl(((blockHeader_t*)p - 1)->size) - ARENA_MIN_SHIFT;
+    *(void**)p = a->freeList[cls];
+    a->freeList[cls] = p;
+    p = next;
+  }
+}
+
+static void* arenaAlloc(size_t size)
+{
+  arena_t* a = getArena();
+  __atomic_store_n(&a->allocs, a->allocs + 1, __ATOMIC_RELAXED);
+
+  blockHeader_t* h;
+  if (size > (1 << ARENA_MAX_SHIFT))
+  {
+    h = heapAlloc(a, sizeof(blockHeader_t) + size);
+    h->arena = NULL;
+    h->size = size;
+    return h + 1;
+  }
+
+  unsigned shift = ARENA_MIN_SHIFT;
+  while (((size_t)1 << shift) < size) ++shift;
+  unsigned cls = shift - ARENA_MIN_SHIFT;
+
+  if (!a->freeList[cls] && a->remote)
+    collectRemote(a);
+
+  void* p = a->freeList[cls];
+  if (p)
+  {
+    a->freeList[cls] = *(void**)p;
+    return p;
+  }
+
+  size_t blockSize = sizeof(blockHeader_t) + ((size_t)1 << shift);
+  if (a->bump + blockSize > a->bumpEnd)
+  {
+    // The tail of the old chunk is abandoned, it's at most one large block
+    a->bump = heapAlloc(a, ARENA_CHUNK_SIZE);
+    a->bumpEnd = a->bump + ARENA_CHUNK_SIZE;
+  }
+  h = (blockHeader_t*)a->bump;
+  a->bump += blockSize;
+  h->arena = a;
+  h->size = (size_t)1 << shift;
+  return h + 1;
+}
+
+static void arenaFree(void* p, __attribute__ ((unused)) size_t size)
+{
+  blockHeader_t* h = (blockHeader_t*)p - 1;
+  arena_t* a = h->arena;
+  if (!a)
+  {
+    free(h);
+  }
+  else if (a == threadArena)
+  {
+    unsigned cls = __builtin_ctzl(h->size) - ARENA_MIN_SHIFT;
+    *(void**)p = a->freeList[cls];
+    a->freeList[cls] = p;
+  }
+  else
+  {
+    void* head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do
+    {
+      *(void**)p = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, p, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+static void* arenaRealloc(void* p, size_t oldSize, size_t newSize)
+{
+  blockHeader_t* h = (blockHeader_t*)p - 1;
+  if (h->arena && newSize <= h->size) return p;
+
+  void* q = arenaAlloc(newSize);
+  memcpy(q, p, oldSize < newSize ? oldSize : newSize);
+  arenaFree(p, oldSize);
+  return q;
+}
+
+void rh_allocInit()
+{
+  pthread_key_create(&arenaKey, releaseArena);
+  mp_set_memory_functions(arenaAlloc, arenaRealloc, arenaFree);
+}
+
+void rh_getAllocStats(rh_allocStats_t* stats)
+{
+  stats->allocs = stats->heapAllocs = 0;
+  pthread_mutex_lock(&arenaLock);
+  for (arena_t* a = allArenas; a; a = a->next)
+  {
+    stats->allocs += __atomic_load_n(&a->allocs, __ATOMIC_RELAXED);
+    stats->heapAllocs += __atomic_load_n(&a->heapAllocs, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&arenaLock);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <gmp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bits to pre-size mpz temporaries that hold candidates, so they are never
+// regrown while searching.  Covers every size with a fixed width Fermat kernel.
+#define RH_MPZ_BITS (2048 + 2 * GMP_NUMB_BITS)
+
+// Installs the per-thread arena allocator as GMP's memory functions.
+// Must be called before anything allocates GMP memory.
+void rh_allocInit();
+
+// Counts of GMP allocations since start up, and of those that had to go
+// to the heap.  Once every thread's arena is warm the heap count stops.
+typedef struct
+{
+  uint64_t allocs;
+  uint64_t heapAllocs;
+} rh_allocStats_t;
+
+void rh_getAllocStats(rh_allocStats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include "rh_cancel.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#ifdef SYS_futex
+#include <linux/futex.h>
+#endif
+
+uint64_t rh_cancelNow()
+{
+  struct timespec tv;
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return (uint64_t)tv.tv_sec * 1000000000ull + tv.tv_nsec;
+}
+
+void rh_cancelListen(rh_cancel_t* cancel, rh_cancelListener_t fn, void* arg)
+{
+  unsigned n = cancel->numListeners;
+  if (n == RH_CANCEL_MAX_LISTENERS)
+  {
+    printf("Too many cancel listeners\n");
+    return;
+  }
+  cancel->listeners[n] = fn;
+  cancel->listenerArgs[n] = arg;
+  __atomic_store_n(&cancel->numListeners, n + 1, __ATOMIC_RELEASE);
+}
+
+void rh_cancelMove(rh_cancel_t* cancel)
+{
+  // The time is published by the epoch's release
+  __atomic_store_n(&cancel->movedAt, rh_cancelNow(), __ATOMIC_RELAXED);
+  __atomic_add_fetch(&cancel->epoch, 1, __ATOMIC_RELEASE);
+#ifdef SYS_futex
+  syscall(SYS_futex, &cancel->epoch, FUTEX_WAKE_PRIVATE, 0x7fffffff, NULL, NULL, 0);
+#endif
+
+  unsigned n = __atomic_load_n(&cancel->numListeners, __ATOMIC_ACQUIRE);
+  for (unsigned i = 0; i < n; ++i)
+    cancel->listeners[i](cancel->listenerArgs[i]);
+}
+
+int rh_cancelSleep(rh_cancel_t* cancel, uint32_t epoch, unsigned us)
+{
+  struct timespec timeout;
+  timeout.tv_sec = us / 1000000;
+  timeout.tv_nsec = (us % 1000000) * 1000;
+#ifdef SYS_futex
+  // Returns straight away if the epoch has already moved
+  syscall(SYS_futex, &cancel->epoch, FUTEX_WAIT_PRIVATE, epoch, &timeout, NULL, 0);
+#else
+  if (!rh_cancelled(cancel, epoch))
+    nanosleep(&timeout, NULL);
+#endif
+  return rh_cancelled(cancel, epoch);
+}
+
+void rh_cancelStopped(rh_cancel_t* cancel, uint32_t epoch)
+{
+  if (!rh_cancelled(cancel, epoch)) return;
+
+  // A later move may have come in since, making it look sooner
+  uint64_t now = rh_cancelNow(), movedAt = __atomic_load_n(&cancel->movedAt, __ATOMIC_RELAXED);
+  uint64_t us = now > movedAt ? (now - movedAt) / 1000 : 0;
+  unsigned bucket = 0;
+  while (bucket < RH_CANCEL_BUCKETS - 1 && us >= (1ull << bucket))
+    ++bucket;
+  __atomic_add_fetch(&cancel->latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void rh_cancelGetLatency(rh_cancel_t* cancel, uint64_t* buckets)
+{
+  for (unsigned i = 0; i < RH_CANCEL_BUCKETS; ++i)
+    buckets[i] = __atomic_load_n(&cancel->latency[i], __ATOMIC_RELAXED);
+}
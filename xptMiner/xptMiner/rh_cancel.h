@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Epoch cancellation.  Work notes the epoch it starts in and stops once
+// the epoch has moved on, which costs one acquire load wherever a loop
+// checks it.  Moving the epoch wakes threads sleeping in rh_cancelSleep
+// at once, through a futex, and calls the listeners so threads parked on
+// anything else can be woken too.  The time from a move to the work
+// under the old epoch stopping is kept as a histogram.
+//
+// A zeroed rh_cancel_t is ready to use.
+
+#define RH_CANCEL_MAX_LISTENERS 32
+#define RH_CANCEL_BUCKETS 24 // Bucket i counts latencies under 2^i us
+
+typedef void (*rh_cancelListener_t)(void* arg);
+
+typedef struct
+{
+  volatile uint32_t epoch;   // Futex word
+  volatile uint64_t movedAt; // rh_cancelNow() of the last move
+  volatile unsigned numListeners;
+  rh_cancelListener_t listeners[RH_CANCEL_MAX_LISTENERS];
+  void* listenerArgs[RH_CANCEL_MAX_LISTENERS];
+  volatile uint64_t latency[RH_CANCEL_BUCKETS];
+} rh_cancel_t;
+
+static inline uint32_t rh_cancelEpoch(rh_cancel_t* cancel)
+{
+  return __atomic_load_n(&cancel->epoch, __ATOMIC_ACQUIRE);
+}
+
+static inline int rh_cancelled(rh_cancel_t* cancel, uint32_t epoch)
+{
+  return rh_cancelEpoch(cancel) != epoch;
+}
+
+// Monotonic nanoseconds
+uint64_t rh_cancelNow();
+
+// fn(arg) is called on the moving thread after every move
+void rh_cancelListen(rh_cancel_t* cancel, rh_cancelListener_t fn, void* arg);
+
+// Cancels everything started in the current epoch
+void rh_cancelMove(rh_cancel_t* cancel);
+
+// Sleeps for us microseconds unless the epoch moves on from epoch first.
+// Returns nonzero if it has.
+int rh_cancelSleep(rh_cancel_t* cancel, uint32_t epoch, unsigned us);
+
+// Records that work started in epoch has stopped, once it has been cancelled
+void rh_cancelStopped(rh_cancel_t* cancel, uint32_t epoch);
+
+// Copies out the RH_CANCEL_BUCKETS latency counts
+void rh_cancelGetLatency(rh_cancel_t* cancel, uint64_t* buckets);
+
+#ifdef __cplusplus
+}
+#endif
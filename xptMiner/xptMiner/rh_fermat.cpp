@@ -0,0 +1,340 @@
+// Fixed width base 2 Fermat test for the host.
+//
+// This is the design of my_fermat_test in epiphany/src/e_primetest.c:
+// Montgomery form throughout, a square and REDC for every bit of n-1,
+// and a shift with conditional subtract instead of a multiply for the
+// set bits.  Unlike mpz_powm there is no allocation or normalisation,
+// no multiplies for the set bits, and all the loops have a compile time
+// length so they can be unrolled.
+
+#include "rh_fermat.h"
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FERMAT_SIMD
+#endif
+
+#if GMP_NUMB_BITS == 64
+typedef unsigned __int128 mp_dlimb_t;
+#else
+typedef unsigned long long mp_dlimb_t;
+#endif
+
+namespace
+{
+
+template <int N>
+inline mp_limb_t subN(mp_ptr rp, mp_srcptr ap, mp_srcptr bp)
+{
+  mp_limb_t br = 0;
+  for (int i = 0; i < N; ++i)
+  {
+    mp_dlimb_t d = (mp_dlimb_t)ap[i] - bp[i] - br;
+    rp[i] = (mp_limb_t)d;
+    br = (mp_limb_t)(d >> GMP_NUMB_BITS) & 1;
+  }
+  return br;
+}
+
+// rp = REDC(tp) for 2N limb tp, leaving rp < B^N.  tp is overwritten.
+template <int N>
+inline void redcN(mp_ptr rp, mp_ptr tp, mp_srcptr mp, mp_limb_t mi)
+{
+  for (int i = 0; i < N; ++i)
+    tp[i] = mpn_addmul_1(tp + i, mp, N, tp[i] * mi);
+  if (mpn_add_n(rp, tp + N, tp, N))
+    subN<N>(rp, rp, mp);
+}
+
+// Base 2 Fermat test of the N limb odd number mp
+template <int N>
+int fermatTest(mp_srcptr mp)
+{
+  mp_limb_t r[N], ep[N], t[2*N];
+
+  // r = B^N mod m, which is 1 in Montgomery form
+  {
+    mp_limb_t q[2], bn[N+1];
+    for (int i = 0; i < N; ++i) bn[i] = 0;
+    bn[N] = 1;
+    mpn_tdiv_qr(q, r, 0, bn, N+1, mp, N);
+  }
+
+  // mi = -1/m mod B by Newton iteration, each step doubles the correct bits
+  mp_limb_t mi = mp[0];
+  for (int i = 0; i < 5; ++i) mi *= 2 - mp[0] * mi;
+  mi = -mi;
+
+  // Exponent m-1, m is odd so there is no borrow
+  ep[0] = mp[0] - 1;
+  for (int i = 1; i < N; ++i) ep[i] = mp[i];
+
+  int en = N;
+  mp_limb_t bit = (mp_limb_t)1 << (GMP_NUMB_BITS - 1 - __builtin_clzl(ep[N-1]));
+  while (en-- > 0)
+  {
+    mp_limb_t w = ep[en];
+    do
+    {
+      mpn_sqr(t, r, N);
+      redcN<N>(r, t, mp, mi);
+      if (w & bit)
+      {
+        mp_limb_t carry = mpn_lshift(r, r, N, 1);
+        while (carry)
+          carry -= subN<N>(r, r, mp);
+      }
+      bit >>= 1;
+    }
+    while (bit > 0);
+    bit = (mp_limb_t)1 << (GMP_NUMB_BITS - 1);
+  }
+
+  // Out of Montgomery form, giving r <= m
+  for (int i = 0; i < N; ++i) { t[i] = r[i]; t[i+N] = 0; }
+  redcN<N>(r, t, mp, mi);
+
+  if (r[0] != 1) return 0;
+  for (int i = 1; i < N; ++i) if (r[i] != 0) return 0;
+  return 1;
+}
+
+// Table of kernels indexed by limb count, built from the largest down
+template <int N>
+struct FermatTable : FermatTable<N-1>
+{
+  FermatTable() { this->tests[N] = fermatTest<N>; }
+};
+
+template <>
+struct FermatTable<RH_FERMAT_MIN_LIMBS-1>
+{
+  rh_fermatTest_t tests[RH_FERMAT_MAX_LIMBS+1];
+};
+
+const FermatTable<RH_FERMAT_MAX_LIMBS> fermatTable;
+
+// Batches run the scalar kernel on each number in turn where there is
+// no vector support.
+void fermatBatchScalar(const mp_srcptr* numbers, mp_size_t limbs, unsigned count, int* results)
+{
+  rh_fermatTest_t test = rh_selectFermatTest(limbs);
+  for (unsigned k = 0; k < count; ++k)
+    results[k] = test(numbers[k]);
+}
+
+#ifdef FERMAT_SIMD
+
+// The vector kernels test one number per lane, with each held as L limbs
+// of W bits so that limb products fit the vector multipliers.  R = 2^(W*L)
+// is at least 16m, which keeps Montgomery products of inputs below 4m
+// under 2m, so neither REDC nor doubling needs a conditional subtract.
+// Lanes take different exponent bits, so doubling is a masked add.
+
+#define SIMD_MAX_LIMBS(W) ((RH_FERMAT_MAX_LIMBS*GMP_NUMB_BITS + 4 + (W) - 1) / (W))
+
+// Number of W bit limbs for an n limb modulus
+inline unsigned simdLimbs(mp_size_t n, unsigned w)
+{
+  return (n*GMP_NUMB_BITS + 4 + w - 1) / w;
+}
+
+// out[j*stride] = limb j of xp in radix 2^w
+void splitLimbs(mp_srcptr xp, mp_size_t n, unsigned w, unsigned L, uint64_t* out, unsigned stride)
+{
+  for (unsigned j = 0; j < L; ++j)
+  {
+    uint64_t v = 0;
+    for (unsigned got = 0; got < w; )
+    {
+      unsigned b = j*w + got;
+      mp_size_t limb = b / GMP_NUMB_BITS;
+      if (limb >= n) break;
+      v |= (uint64_t)(xp[limb] >> (b % GMP_NUMB_BITS)) << got;
+      got += GMP_NUMB_BITS - (b % GMP_NUMB_BITS);
+    }
+    out[j*stride] = v & (((uint64_t)1 << w) - 1);
+  }
+}
+
+// Sets up lane of the modulus, the Montgomery form of 1 and -1/m mod 2^w
+// for the n limb odd number mp
+void prepareLane(mp_srcptr mp, mp_size_t n, unsigned w, unsigned L, unsigned lanes, unsigned lane,
+                 uint64_t* m, uint64_t* one, uint64_t* mi)
+{
+  splitLimbs(mp, n, w, L, m + lane, lanes);
+
+  // R mod m
+  const mp_size_t rn = (w*L) / GMP_NUMB_BITS + 1;
+  mp_limb_t bn[RH_FERMAT_MAX_LIMBS+4], q[6], r[RH_FERMAT_MAX_LIMBS];
+  for (mp_size_t i = 0; i < rn; ++i) bn[i] = 0;
+  bn[rn-1] = (mp_limb_t)1 << ((w*L) % GMP_NUMB_BITS);
+  mpn_tdiv_qr(q, r, 0, bn, rn, mp, n);
+  splitLimbs(r, n, w, L, one + lane, lanes);
+
+  uint64_t m0 = m[lane], inv = m0;
+  for (int i = 0; i < 5; ++i) inv *= 2 - m0 * inv;
+  mi[lane] = -inv & (((uint64_t)1 << w) - 1);
+}
+
+// Exponent bit b of each lane
+inline unsigned laneBits(const mp_limb_t (*ep)[RH_FERMAT_MAX_LIMBS], unsigned lanes, unsigned b)
+{
+  unsigned bits = 0;
+  for (unsigned lane = 0; lane < lanes; ++lane)
+    bits |= ((ep[lane][b / GMP_NUMB_BITS] >> (b % GMP_NUMB_BITS)) & 1) << lane;
+  return bits;
+}
+
+// Copies the exponents m-1 of each lane, returning the highest bit count,
+// so the ladder doesn't square through the top limb's leading zeros.
+// m-1 has m's bit length, as m is odd and above 2.
+unsigned prepareExponents(const mp_srcptr* numbers, mp_size_t n, unsigned count, unsigned lanes,
+                          mp_limb_t (*ep)[RH_FERMAT_MAX_LIMBS])
+{
+  unsigned bits = 0;
+  for (unsigned lane = 0; lane < lanes; ++lane)
+  {
+    mp_srcptr mp = numbers[lane < count ? lane : 0];
+    for (mp_size_t i = 0; i < n; ++i) ep[lane][i] = mp[i];
+    ep[lane][0] -= 1;
+    unsigned size = mpn_sizeinbase(mp, n, 2);
+    if (size > bits) bits = size;
+  }
+  return bits;
+}
+
+#define IFMA_W     52
+#define IFMA_LANES 8
+#define IFMA_MAX_LIMBS SIMD_MAX_LIMBS(IFMA_W)
+
+// The carry out of a 52 bit limb.  The unmasked _mm512_srli_epi64 passes
+// GCC an uninitialised vector for the masked off lanes it doesn't have.
+__attribute__((target("avx512f")))
+inline __m512i carryIFMA(__m512i v)
+{
+  return _mm512_maskz_srli_epi64(0xFF, v, IFMA_W);
+}
+
+// rp = REDC(ap * bp) with 52 bit limbs, using the AVX-512 IFMA low and high
+// half multiply-adds.  Inputs must have normalised limbs.
+__attribute__((target("avx512f,avx512ifma")))
+void montMulIFMA(__m512i* rp, const __m512i* ap, const __m512i* bp, const __m512i* mp, __m512i mi, unsigned L)
+{
+  const __m512i mask = _mm512_set1_epi64((1ull << IFMA_W) - 1);
+  const __m512i zero = _mm512_setzero_si512();
+  __m512i t[2*IFMA_MAX_LIMBS+1] = {};
+
+  for (unsigned i = 0; i < L; ++i)
+  {
+    for (unsigned j = 0; j < L; ++j)
+    {
+      t[i+j] = _mm512_madd52lo_epu64(t[i+j], ap[i], bp[j]);
+      t[i+j+1] = _mm512_madd52hi_epu64(t[i+j+1], ap[i], bp[j]);
+    }
+    __m512i q = _mm512_madd52lo_epu64(zero, t[i], mi);
+    for (unsigned j = 0; j < L; ++j)
+    {
+      t[i+j] = _mm512_madd52lo_epu64(t[i+j], q, mp[j]);
+      t[i+j+1] = _mm512_madd52hi_epu64(t[i+j+1], q, mp[j]);
+    }
+    t[i+1] = _mm512_add_epi64(t[i+1], carryIFMA(t[i]));
+  }
+
+  __m512i carry = zero;
+  for (unsigned j = 0; j < L; ++j)
+  {
+    __m512i v = _mm512_add_epi64(t[L+j], carry);
+    rp[j] = _mm512_and_si512(v, mask);
+    carry = carryIFMA(v);
+  }
+}
+
+__attribute__((target("avx512f,avx512ifma")))
+void fermatBatchIFMA(const mp_srcptr* numbers, mp_size_t n, unsigned count, int* results)
+{
+  const unsigned L = simdLimbs(n, IFMA_W);
+  uint64_t m[IFMA_MAX_LIMBS*IFMA_LANES], one[IFMA_MAX_LIMBS*IFMA_LANES], mi[IFMA_LANES];
+  mp_limb_t ep[IFMA_LANES][RH_FERMAT_MAX_LIMBS];
+
+  // Unused lanes repeat the first number
+  for (unsigned lane = 0; lane < IFMA_LANES; ++lane)
+    prepareLane(numbers[lane < count ? lane : 0], n, IFMA_W, L, IFMA_LANES, lane, m, one, mi);
+  unsigned bits = prepareExponents(numbers, n, count, IFMA_LANES, ep);
+
+  const __m512i mask = _mm512_set1_epi64((1ull << IFMA_W) - 1);
+  __m512i mv[IFMA_MAX_LIMBS], r[IFMA_MAX_LIMBS];
+  for (unsigned j = 0; j < L; ++j)
+  {
+    mv[j] = _mm512_loadu_si512(&m[j*IFMA_LANES]);
+    r[j] = _mm512_loadu_si512(&one[j*IFMA_LANES]);
+  }
+  __m512i miv = _mm512_loadu_si512(mi);
+
+  while (bits-- > 0)
+  {
+    montMulIFMA(r, r, r, mv, miv, L);
+    __mmask8 doubling = laneBits(ep, IFMA_LANES, bits);
+    if (doubling)
+    {
+      __m512i carry = _mm512_setzero_si512();
+      for (unsigned j = 0; j < L; ++j)
+      {
+        __m512i v = _mm512_add_epi64(_mm512_mask_add_epi64(r[j], doubling, r[j], r[j]), carry);
+        r[j] = _mm512_and_si512(v, mask);
+        carry = carryIFMA(v);
+      }
+    }
+  }
+
+  // Out of Montgomery form, giving r <= m
+  __m512i unit[IFMA_MAX_LIMBS];
+  unit[0] = _mm512_set1_epi64(1);
+  for (unsigned j = 1; j < L; ++j) unit[j] = _mm512_setzero_si512();
+  montMulIFMA(r, r, unit, mv, miv, L);
+
+  __mmask8 isOne = _mm512_cmpeq_epi64_mask(r[0], unit[0]);
+  for (unsigned j = 1; j < L; ++j)
+    isOne &= _mm512_cmpeq_epi64_mask(r[j], unit[1]);
+  for (unsigned k = 0; k < count; ++k)
+    results[k] = (isOne >> k) & 1;
+}
+
+#endif
+
+}
+
+rh_fermatTest_t rh_selectFermatTest(mp_size_t limbs)
+{
+  if (limbs < RH_FERMAT_MIN_LIMBS || limbs > RH_FERMAT_MAX_LIMBS) return 0;
+  return fermatTable.tests[limbs];
+}
+
+const char* const rh_fermatBatchNames[] = { "AVX-512 IFMA", "scalar", 0 };
+
+rh_fermatBatch_t rh_getFermatBatch(unsigned kernel, mp_size_t limbs, unsigned* lanes)
+{
+  if (limbs < 1 || limbs > RH_FERMAT_MAX_LIMBS) return 0;
+  switch (kernel)
+  {
+#ifdef FERMAT_SIMD
+  case 0:
+    if (!__builtin_cpu_supports("avx512ifma")) return 0;
+    *lanes = IFMA_LANES;
+    return fermatBatchIFMA;
+#endif
+  case 1:
+    if (!rh_selectFermatTest(limbs)) return 0;
+    *lanes = RH_FERMAT_MAX_LANES;
+    return fermatBatchScalar;
+  }
+  return 0;
+}
+
+rh_fermatBatch_t rh_selectFermatBatch(mp_size_t limbs, unsigned* lanes)
+{
+  rh_fermatBatch_t batch = rh_getFermatBatch(0, limbs, lanes);
+  if (!batch) batch = rh_getFermatBatch(1, limbs, lanes);
+  return batch;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <gmp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Base 2 Fermat test of an n limb odd number, returns non-zero if 2^(n-1) == 1 mod n
+typedef int (*rh_fermatTest_t)(mp_srcptr);
+
+// Candidate sizes with a fixed width kernel.  GMP is as fast below this
+// range, and difficulty will be a long time reaching the top of it.
+#define RH_FERMAT_MIN_LIMBS (1024 / GMP_NUMB_BITS)
+#define RH_FERMAT_MAX_LIMBS (2048 / GMP_NUMB_BITS)
+
+// Returns the kernel for candidates of the given number of limbs,
+// or NULL if there isn't one and GMP should be used.
+rh_fermatTest_t rh_selectFermatTest(mp_size_t limbs);
+
+// Base 2 Fermat tests of count odd numbers of the given limb count, one per
+// vector lane where the CPU allows.  Sets results[k] non-zero for each that passes.
+typedef void (*rh_fermatBatch_t)(const mp_srcptr*, mp_size_t, unsigned, int*);
+
+#define RH_FERMAT_MAX_LANES 8
+
+// Returns the fastest batch test for numbers of the given limb count and
+// sets lanes to the batch size it is best called with, or returns NULL
+// if there is no batch test for that size.
+rh_fermatBatch_t rh_selectFermatBatch(mp_size_t limbs, unsigned* lanes);
+
+// The individual batch tests, in order of preference, for testing.
+// rh_getFermatBatch returns NULL if the CPU doesn't support the kernel.
+extern const char* const rh_fermatBatchNames[];
+rh_fermatBatch_t rh_getFermatBatch(unsigned kernel, mp_size_t limbs, unsigned* lanes);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include "rh_numa.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Memory policies, as in <numaif.h>.  The syscalls are made directly so
+// there's no dependency on libnuma.
+#define MPOL_PREFERRED 1
+
+typedef struct
+{
+  unsigned sysNode; // Number of the node under /sys
+  unsigned cpus;
+  cpu_set_t cpuset;
+} numaNode_t;
+
+static numaNode_t nodes[RH_NUMA_MAX_NODES];
+static unsigned numNodes = 1;
+
+// Parses a cpulist like "0-3,8-11"
+static unsigned parseCpuList(FILE* f, cpu_set_t* cpuset)
+{
+  unsigned count = 0, first, last;
+  CPU_ZERO(cpuset);
+  while (fscanf(f, "%u", &first) == 1)
+  {
+    last = first;
+    int c = fgetc(f);
+    if (c == '-')
+    {
+      if (fscanf(f, "%u", &last) != 1) break;
+      c = fgetc(f);
+    }
+    for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu, ++count)
+      CPU_SET(cpu, cpuset);
+    if (c != ',') break;
+  }
+  return count;
+}
+
+void rh_numaInit()
+{
+  unsigned found = 0;
+  for (unsigned n = 0; n < 64 && found < RH_NUMA_MAX_NODES; ++n)
+  {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", n);
+    FILE* f = fopen(path, "r");
+    if (!f) continue;
+    nodes[found].sysNode = n;
+    nodes[found].cpus = parseCpuList(f, &nodes[found].cpuset);
+    fclose(f);
+
+    // Memory only nodes get no workers
+    if (nodes[found].cpus) ++found;
+  }
+
+  if (found > 1)
+  {
+    numNodes = found;
+    printf("NUMA: %u nodes\n", numNodes);
+    for (unsigned n = 0; n < numNodes; ++n)
+      printf("  node %u: %u cpus\n", nodes[n].sysNode, nodes[n].cpus);
+  }
+  else
+  {
+    numNodes = 1;
+    nodes[0].sysNode = 0;
+    nodes[0].cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+}
+
+unsigned rh_numaNodes()
+{
+  return numNodes;
+}
+
+unsigned rh_numaNodeCpus(unsigned node)
+{
+  return nodes[node].cpus;
+}
+
+unsigned rh_numaNodeOfCpu(unsigned cpu)
+{
+  for (unsigned n = 0; n < numNodes; ++n)
+    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &nodes[n].cpuset))
+      return n;
+  return 0;
+}
+
+void rh_numaBindThread(unsigned node)
+{
+  if (numNodes < 2) return;
+
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &nodes[node].cpuset);
+#ifdef SYS_set_mempolicy
+  unsigned long mask = 1ul << nodes[node].sysNode;
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) != 0)
+    printf("NUMA: Failed to set memory policy for node %u\n", nodes[node].sysNode);
+#endif
+}
+
+void rh_numaPlace(void* p, size_t size, unsigned node)
+{
+  if (numNodes < 2) return;
+
+#ifdef SYS_mbind
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t)p + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t)p + size) & ~(page - 1);
+  if (end <= start) return;
+
+  unsigned long mask = 1ul << nodes[node].sysNode;
+  if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0)
+    printf("NUMA: Failed to place memory on node %u\n", nodes[node].sysNode);
+#endif
+}
+
+void* rh_numaAlloc(size_t size, unsigned node)
+{
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+  {
+    printf("Out of memory allocating %uMB on node %u\n", (unsigned)(size >> 20), node);
+    exit(-1);
+  }
+  rh_numaPlace(p, size, node);
+  return p;
+}
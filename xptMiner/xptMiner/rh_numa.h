@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NUMA placement, from the topology in /sys/devices/system/node.  Without
+// it, or on a single node host, there is one node and binding does nothing.
+
+#define RH_NUMA_MAX_NODES 8
+
+void rh_numaInit();
+
+// Nodes with CPUs, numbered from 0 in the order the kernel lists them
+unsigned rh_numaNodes();
+unsigned rh_numaNodeCpus(unsigned node);
+unsigned rh_numaNodeOfCpu(unsigned cpu);
+
+// Runs the calling thread on node's CPUs, preferring its memory for
+// anything the thread allocates from now on
+void rh_numaBindThread(unsigned node);
+
+// Page aligned memory placed on node.  Never freed.
+void* rh_numaAlloc(size_t size, unsigned node);
+
+// Places pages of [p, p+size) on node as they are first touched.  Pages
+// shared with memory either side are left as they are.
+void rh_numaPlace(void* p, size_t size, unsigned node);
+
+#ifdef __cplusplus
+}
+#endif
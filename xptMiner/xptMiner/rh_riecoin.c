@@ -18,11 +18,19 @@
 #include <stdint.h>
 #include <math.h>
 #include <gmp.h>
+#include <unistd.h>
 
 #include <e-hal.h>
 #include <e-loader.h>
 
 #include "rh_riecoin.h"
+#include "rh_fermat.h"
+#include "rh_alloc.h"
+#include "rh_sched.h"
+#include "rh_numa.h"
+#include "rh_affinity.h"
+#include "rh_cancel.h"
+#include "rh_stats.h"
 
 #undef REPORT_TESTS
 //#define REPORT_TESTS
@@ -41,12 +49,27 @@
 #define SIEVE_SIZE       (8*2400000)
 #define OFFSETS_SIZE     ((SIEVE_SIZE>>3) < PRIME_TABLE_SIZE ? (SIEVE_SIZE>>3) : PRIME_TABLE_SIZE)
 
-static unsigned int *primeTable;
+// Primes up to MAX_SIEVE_PRIME are stored as half the gap from the previous
+// prime, which fits in a byte below 10^9.  The prime itself is stored every
+// PRIME_CHECKPOINT_INTERVAL entries for random access.  Index 0 is 3.
+#define PRIME_CHECKPOINT_SHIFT    6
+#define PRIME_CHECKPOINT_INTERVAL (1 << PRIME_CHECKPOINT_SHIFT)
+#define PRIME_CHECKPOINTS         ((PRIME_TABLE_SIZE + PRIME_CHECKPOINT_INTERVAL - 1) >> PRIME_CHECKPOINT_SHIFT)
+static unsigned char *primeGaps;
+static unsigned int *primeCheckpoints;
+static unsigned int *lowPrimes;  // Uncompressed, the first LOW_PRIME_IDX primes
 static unsigned int *primeTableInverses;
-static unsigned int *primeSieve;
-static unsigned int *sieveOffsets[6];
-static unsigned int *sieve;
-static unsigned int *sieveHighPrime;
+static unsigned sieveSizePrimeIdx; // Index of the first prime > SIEVE_SIZE
+static unsigned int *primeSieve; // Only while the prime table is built
+
+// The compressed prime table is read throughout sieving, so each node
+// has its own copy.  Node 0's is primeGaps and primeCheckpoints.
+typedef struct
+{
+  unsigned char* gaps;
+  unsigned int* checkpoints;
+} primeTable_t;
+static primeTable_t nodePrimes[RH_NUMA_MAX_NODES];
 
 #define FIRST_PRIME_INDEX 39 // First prime index to use in sieving (not including 2).
 static unsigned int qGenMult[8] = { 223092870, 2756205443, 907383479, 4132280413, 121330189, 257557397, 490995677, 27221 };
@@ -56,7 +79,16 @@ static unsigned int qGenMult[8] = { 223092870, 2756205443, 907383479, 4132280413
 // b = 2^(trailingBits+264) + hash * 2^trailingBits
 // q# = primorial
 // x + 16057 = xPlus16057
-static mpz_t base, hashnum, primorial, xPlus16057;
+static mpz_t primorial;
+
+// Everything about a search that depends only on its target, so that it
+// can be prepared ahead of time.
+struct rh_workUnit_s
+{
+  mpz_t base;
+  mpz_t xPlus16057;
+  unsigned* sieveOffsets[6]; // Initial offsets for the primes below LOW_PRIME_IDX
+};
 
 // Epiphany data
 #include "modp_data.h"
@@ -71,15 +103,151 @@ static e_mem_t epip_mem;
 #define EPIP_PTEST_IN_OFFSET(CORE)  EPIP_OFFSET(CORE)
 #define EPIP_PTEST_OUT_OFFSET(CORE) (EPIP_OFFSET(CORE) + sizeof(ptest_indata_t))
 
+// There is one Epiphany for all the engines.  An engine holds it while it
+// sieves, and for testing if it's free, otherwise its host threads test.
+static pthread_mutex_t epipLock = PTHREAD_MUTEX_INITIALIZER;
+
 static reportSuccess_t reportSuccess;
 static checkRestart_t checkRestart;
-static volatile unsigned cancelEverything;
-static volatile unsigned lowSieveDone;
-static pthread_t test_tid[2];
+
+// Moved on by rh_cancelSearches() when the block changes
+static rh_cancel_t searchCancel;
+
+#define TASK_SIEVE 1       // Primes below SIEVE_SIZE, by prime index
+#define TASK_HIGH_PRIMES 2 // A page of Epiphany results above SIEVE_SIZE
+#define TASK_TEST 4        // Sieve survivors, by sieve index
+#define TASK_CLEAR 8       // A segment of a used sieve, only when there's nothing else
+#define SIEVE_GRAIN 2048   // Primes
+#define TEST_GRAIN 4096    // Sieve indexes
+
+// Scheduler classes, so test ranges are shared out by each backend's speed
+#define WORKER_HOST 0
+#define WORKER_EPIPHANY 1
+
+// The low primes are sieved a segment at a time, each under its lock
+#define SIEVE_SEGMENT_SIZE 2400000
+#define SIEVE_SEGMENTS (SIEVE_SIZE / SIEVE_SEGMENT_SIZE)
 
 #define SIEVE_BLOCK_SIZE 80000
 #define START_BLOCK 5
-static volatile unsigned nextSieveIdx;
+
+// Pages of Epiphany results for primes above SIEVE_SIZE are copied out
+// and marked by the workers, while the search thread gets on with
+// reading the next ones.
+#define HIGH_PRIME_PAGES 32
+
+typedef struct
+{
+  rh_engine_t* engine;
+  unsigned j, p; // First prime in the page
+  modp_result_t result[MODP_RESULTS_PER_PAGE];
+} highPrimePage_t;
+
+// Breadth first tuple testing.  Each tester keeps a queue of candidates
+// waiting for each stage, and tests a stage's member across a full batch
+// of them at once.  The early exits are the same as singleTest's, so the
+// tuples reported don't change, just the order.
+typedef struct
+{
+  unsigned is[TUPLE_MEMBERS][RH_FERMAT_MAX_LANES]; // Queued candidates for each stage
+  unsigned primes[TUPLE_MEMBERS][RH_FERMAT_MAX_LANES];
+  unsigned count[TUPLE_MEMBERS];
+  unsigned batchSize;
+  mpz_t candidates[RH_FERMAT_MAX_LANES];
+  mpz_t report, testpow, testres, two;
+} tuplePipeline_t;
+
+typedef struct
+{
+  rh_engine_t* engine;
+  unsigned worker;
+} workerArg_t;
+
+// A search engine: the state of the search in progress and the threads
+// working on it.  The prime tables, the Epiphany and the tuple statistics
+// are shared, so a process can run several engines, each on its own unit.
+struct rh_engine_s
+{
+  unsigned index;
+  void* context; // Passed back to reportSuccess and checkRestart
+
+  mpz_t xPlus16057;
+  mpz_t resultCandidate; // Tuples read back from the Epiphany, only used on the search thread
+  unsigned int* sieveOffsets[6];
+  unsigned int* sieve;
+  unsigned int* sieveHighPrime;
+
+  // Two of each sieve, so the one a unit used can be cleared by the
+  // workers while the next unit sieves into the other
+  unsigned int* sieves[2];
+  unsigned int* sieveHighPrimes[2];
+  unsigned sieveBuffer;
+
+  // For the gap between units, from rh_cancelNow(): when the last unit's
+  // tests finished, 0 if it was cancelled, and the first sieve write
+  uint64_t lastTestsDone;
+  volatile uint64_t firstSieveAt;
+
+  // Fixed width Fermat test for candidates the size of xPlus16057, if there is one
+  rh_fermatTest_t fermatTest;
+  mp_size_t fermatLimbs;
+  rh_fermatBatch_t fermatBatch;
+  unsigned fermatLanes;
+  unsigned memberOrder[TUPLE_MEMBERS];
+
+  uint32_t epoch; // searchCancel epoch the unit was started in
+  volatile unsigned cancelEverything;
+  volatile unsigned lowSieveDone;
+  pthread_mutex_t segmentLock[SIEVE_SEGMENTS];
+  volatile unsigned lowSievePrimes; // Primes sieved so far this unit
+  volatile unsigned testsLeft;      // Sieve indexes not yet handed out
+
+  // Host work is done by a pool of tester threads, started once, that
+  // take the sieve, high prime and test tasks of each unit from a work
+  // stealing scheduler and park between units.  The search thread is one
+  // more worker, feederWorker, which takes only test tasks and sends them
+  // to the Epiphany, or tests them itself when another engine has it.
+  unsigned numTesters;
+  unsigned feederWorker;
+  unsigned firstTester; // Index of tester 0 among all the engines' testers
+  rh_sched_t sched;
+  tuplePipeline_t* pipelines; // One for each worker
+  workerArg_t* workerArgs;
+  int searchPinned;
+  int feedingEpiphany;
+
+  // Workers are spread over the nodes from firstNode, and each node tests
+  // the part of the sieve that is in its memory.  The feeder runs on firstNode.
+  unsigned firstNode;
+  unsigned numNodes;
+  unsigned* workerNode;
+  unsigned nodeSieveBegin[RH_NUMA_MAX_NODES], nodeSieveEnd[RH_NUMA_MAX_NODES];
+
+  highPrimePage_t highPrimePages[HIGH_PRIME_PAGES];
+  highPrimePage_t* freeHighPrimePages[HIGH_PRIME_PAGES];
+  unsigned numFreeHighPrimePages;
+  pthread_mutex_t highPrimePageLock;
+
+  modp_indata_t modp_inbuf;
+  modp_outdata_t modp_outbuf;
+
+  // Candidates waiting to go to each Epiphany core, and the cores that
+  // have been started and not read since, only used by the feeder
+  ptest_indata_t epipInbuf[16];
+  unsigned epipCore;
+  unsigned epipBusy;
+};
+
+static rh_engine_t** engines;
+static unsigned numEngines;
+
+static unsigned nodeWorkers[RH_NUMA_MAX_NODES];
+
+// Long loops check this at least every few hundred microseconds
+static inline int isCancelled(rh_engine_t* engine)
+{
+  return engine->cancelEverything || rh_cancelled(&searchCancel, engine->epoch);
+}
 
 // return t such that at = 1 mod m
 // a, m < 2^31.
@@ -106,23 +274,188 @@ static unsigned mulmod64(unsigned a, unsigned b, unsigned m)
   return (uint32_t)((((uint64_t)a) * ((uint64_t)b)) % m);
 }
 
+static unsigned tablePrimeAt(const primeTable_t* table, unsigned j)
+{
+  unsigned p = table->checkpoints[j >> PRIME_CHECKPOINT_SHIFT];
+  for (unsigned i = (j & ~(PRIME_CHECKPOINT_INTERVAL - 1)) + 1; i <= j; ++i)
+    p += table->gaps[i] << 1;
+  return p;
+}
+
+static unsigned primeAt(unsigned j)
+{
+  return tablePrimeAt(&nodePrimes[0], j);
+}
+
+// Primes must be stored in order
+static void storePrime(unsigned j, unsigned p, unsigned prevp)
+{
+  primeGaps[j] = (p - prevp) >> 1;
+  if ((j & (PRIME_CHECKPOINT_INTERVAL - 1)) == 0)
+    primeCheckpoints[j >> PRIME_CHECKPOINT_SHIFT] = p;
+}
+
 static void initpattern(unsigned* pattern)
 {
   for (int i = 0; i < 5; ++i)
   {
-    unsigned offset = primeTable[i] >> 1;
+    unsigned offset = lowPrimes[i] >> 1;
     while (offset < (15015 << 5))
     {
       pattern[offset >> 5] |= 1<<(offset&0x1f);
-      offset += primeTable[i];
+      offset += lowPrimes[i];
+    }
+  }
+}
+
+// The prime table is built by a segmented sieve of Eratosthenes over the odd
+// numbers, bit i of primeSieve representing 2i+1.  Each segment starts from
+// the 2.3.5.7.11.13 wheel in pattern, so segments are a multiple of its length.
+#define PRIME_SIEVE_WORDS   ((MAX_SIEVE_PRIME+63)>>6)
+#define PRIME_SEGMENT_WORDS (15015*4)
+#define PRIME_SEGMENTS      ((PRIME_SIEVE_WORDS+PRIME_SEGMENT_WORDS-1)/PRIME_SEGMENT_WORDS)
+
+typedef struct
+{
+  const unsigned* pattern;
+  unsigned firstSegment;
+  unsigned endSegment;
+  unsigned count;     // Primes found in this thread's segments
+  unsigned lastPrime; // The largest of them
+  unsigned tableIdx;  // Index in the prime table of the first of them
+  unsigned prevPrime; // The prime before that
+} primeSieveWork_t;
+
+static void segmentRange(unsigned seg, unsigned* startWord, unsigned* endWord)
+{
+  *startWord = seg * PRIME_SEGMENT_WORDS;
+  *endWord = *startWord + PRIME_SEGMENT_WORDS;
+  if (*endWord > PRIME_SIEVE_WORDS) *endWord = PRIME_SIEVE_WORDS;
+}
+
+static void* primeSieveThread(void* void_work)
+{
+  primeSieveWork_t* work = void_work;
+
+  work->count = 0;
+  work->lastPrime = 0;
+  for (unsigned seg = work->firstSegment; seg < work->endSegment; ++seg)
+  {
+    unsigned startWord, endWord;
+    segmentRange(seg, &startWord, &endWord);
+
+    for (unsigned w = startWord; w < endWord; w += 15015)
+    {
+      unsigned len = endWord - w < 15015 ? endWord - w : 15015;
+      memcpy(&primeSieve[w], work->pattern, sizeof(unsigned) * len);
+    }
+
+    unsigned startBit = startWord << 5;
+    unsigned endBit = endWord << 5;
+    for (unsigned i = 5; i < LOW_PRIME_IDX; ++i)
+    {
+      unsigned p = lowPrimes[i];
+      unsigned offset = p >> 1;
+      if (offset < startBit)
+      {
+        unsigned r = (startBit - offset) % p;
+        offset = r ? startBit + p - r : startBit;
+      }
+      for (; offset < endBit; offset += p)
+        primeSieve[offset >> 5] |= 1<<(offset&0x1f);
+    }
+
+    for (unsigned w = startWord; w < endWord; ++w)
+      work->count += 32 - __builtin_popcount(primeSieve[w]);
+
+    // Bit 0 represents 1, which is left unmarked
+    if (startWord == 0) work->count--;
+
+    for (unsigned w = endWord; w > startWord; --w)
+    {
+      if (primeSieve[w-1] != 0xffffffff)
+      {
+        unsigned i = ((w-1) << 5) + 31 - __builtin_clz(~primeSieve[w-1]);
+        if (i != 0) work->lastPrime = (i<<1) + 1;
+        break;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void* primeTableThread(void* void_work)
+{
+  primeSieveWork_t* work = void_work;
+  unsigned j = work->tableIdx;
+  unsigned prevp = work->prevPrime;
+  unsigned startWord = work->firstSegment * PRIME_SEGMENT_WORDS;
+  unsigned endWord = work->endSegment * PRIME_SEGMENT_WORDS;
+  if (endWord > PRIME_SIEVE_WORDS) endWord = PRIME_SIEVE_WORDS;
+
+  for (unsigned w = startWord; w < endWord && j < PRIME_TABLE_SIZE; ++w)
+  {
+    unsigned bits = ~primeSieve[w];
+    if (w == 0) bits &= ~1;
+    while (bits && j < PRIME_TABLE_SIZE)
+    {
+      unsigned i = (w << 5) + __builtin_ctz(bits);
+      unsigned p = (i<<1) + 1;
+      storePrime(j++, p, prevp);
+      prevp = p;
+      bits &= bits - 1;
     }
   }
+
+  return NULL;
+}
+
+// Sieve primeSieve, and fill the prime table from index j onwards.
+// Each thread counts the primes in its segments, so that once the offsets
+// into the table are known by prefix sum the table can be written in parallel.
+// Returns the number of entries in the prime table.
+static unsigned buildPrimeTable(const unsigned* pattern, unsigned j)
+{
+  long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (numThreads < 1) numThreads = 1;
+  if (numThreads > PRIME_SEGMENTS) numThreads = PRIME_SEGMENTS;
+
+  pthread_t tid[numThreads];
+  primeSieveWork_t work[numThreads];
+  for (long t = 0; t < numThreads; ++t)
+  {
+    work[t].pattern = pattern;
+    work[t].firstSegment = (PRIME_SEGMENTS * t) / numThreads;
+    work[t].endSegment = (PRIME_SEGMENTS * (t + 1)) / numThreads;
+    pthread_create(&tid[t], NULL, primeSieveThread, &work[t]);
+  }
+  for (long t = 0; t < numThreads; ++t)
+    pthread_join(tid[t], NULL);
+
+  unsigned prevp = lowPrimes[j-1];
+  for (long t = 0; t < numThreads; ++t)
+  {
+    work[t].tableIdx = j;
+    work[t].prevPrime = prevp;
+    j += work[t].count;
+    if (work[t].count) prevp = work[t].lastPrime;
+    pthread_create(&tid[t], NULL, primeTableThread, &work[t]);
+  }
+  for (long t = 0; t < numThreads; ++t)
+    pthread_join(tid[t], NULL);
+
+  return j;
 }
 
-void rh_oneTimeInit(reportSuccess_t _reportSuccess, checkRestart_t _checkRestart)
+static rh_engine_t* createEngine(unsigned index, unsigned testers, unsigned firstTester);
+static void startWorkers(rh_engine_t* engine);
+
+void rh_oneTimeInit(reportSuccess_t _reportSuccess, checkRestart_t _checkRestart, unsigned testers, unsigned _engines)
 {
   reportSuccess = _reportSuccess;
   checkRestart = _checkRestart;
+  rh_numaInit();
 
   e_init(NULL);
   e_reset_system();
@@ -136,83 +469,84 @@ void rh_oneTimeInit(reportSuccess_t _reportSuccess, checkRestart_t _checkRestart
   e_open(&epip_dev, 0, 0, epip_platform.rows, epip_platform.cols);
 
   unsigned int p, s, i, j;
-  mpz_init(hashnum);
-  mpz_init(base);
-  mpz_init(xPlus16057);
 
   printf("Initialize prime table size %d\n", PRIME_TABLE_SIZE);
 
-  primeTable = malloc(sizeof(unsigned int) * PRIME_TABLE_SIZE);
+  struct timespec tv;
+  double start, end;
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  start = tv.tv_sec + (tv.tv_nsec / 1000000000.0);
+
+  primeGaps = rh_numaAlloc(PRIME_TABLE_SIZE + 1, 0);
+  primeGaps[PRIME_TABLE_SIZE] = 0;
+  primeCheckpoints = rh_numaAlloc(sizeof(unsigned int) * PRIME_CHECKPOINTS, 0);
+  nodePrimes[0].gaps = primeGaps;
+  nodePrimes[0].checkpoints = primeCheckpoints;
+  lowPrimes = malloc(sizeof(unsigned int) * LOW_PRIME_IDX);
 #ifdef MODP_RESULT_DEBUG
   primeTableInverses = malloc(sizeof(unsigned int) * PRIME_TABLE_SIZE);
 #else
   primeTableInverses = malloc(sizeof(unsigned int) * LOW_PRIME_IDX);
 #endif
 
-  for (i = 0; i < 6; ++i)
-    sieveOffsets[i] = malloc(sizeof(unsigned int) * OFFSETS_SIZE);
-
-  sieve = malloc(SIEVE_SIZE >> 3);
-  sieveHighPrime = malloc(SIEVE_SIZE >> 3);
-
   // Do something simple to gen low primes.
-  primeTable[0] = 3;
-  primeTable[1] = 5;
+  lowPrimes[0] = 3;
+  lowPrimes[1] = 5;
   p = 7;
   s = 3;
   i = 2;
   while (i < LOW_PRIME_IDX)
   {
-    for (j=0; primeTable[j] <= s; ++j)
+    for (j=0; lowPrimes[j] <= s; ++j)
     {
-      if (p%primeTable[j] == 0)
+      if (p%lowPrimes[j] == 0)
         break;
     }
-    if (primeTable[j] > s)
+    if (lowPrimes[j] > s)
     {
-      primeTable[i++] = p;
+      lowPrimes[i++] = p;
     }
     p += 2;
     if (s*s < p) ++s;
   }
   j = i;
+  for (i = 0; i < j; ++i)
+    storePrime(i, lowPrimes[i], i ? lowPrimes[i-1] : lowPrimes[0]);
 
-  // Now sieve
+  // Now sieve, in parallel over L2 sized segments of primeSieve
   unsigned int pattern[15015] = {0};
   initpattern(pattern);
 
   primeSieve = malloc((MAX_SIEVE_PRIME+63)>>4);
-  memset(primeSieve, 0, (MAX_SIEVE_PRIME+63)>>4);
-  for (i = 0; i + 15015 < ((MAX_SIEVE_PRIME+63)>>6); i+=15015)
-  {
-    memcpy(&primeSieve[i], pattern, 15015 * sizeof(int));
-  }
-  memcpy(&primeSieve[i], pattern, sizeof(int) * (((MAX_SIEVE_PRIME+63)>>6) - i));
+  j = buildPrimeTable(pattern, j);
+  free(primeSieve);
+  primeSieve = NULL;
 
-  for (i = 5; i < LOW_PRIME_IDX; ++i)
-  {
-    unsigned offset = primeTable[i] >> 1;
-    while (offset < (MAX_SIEVE_PRIME+63)>>1)
-    {
-      primeSieve[offset >> 5] |= 1<<(offset&0x1f);
-      offset += primeTable[i];
-    }
-    //fprintf(stderr, "%d\r", primeTable[i]);
-  }
-  for (i = 1; i < (MAX_SIEVE_PRIME+63)>>1 && j < PRIME_TABLE_SIZE; ++i)
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  end = tv.tv_sec + (tv.tv_nsec / 1000000000.0);
+  printf("Initialized prime table in %.3f, max prime: %d\n", end - start, primeAt(PRIME_TABLE_SIZE-1));
+  if (j < PRIME_TABLE_SIZE || primeAt(PRIME_TABLE_SIZE-1) != MAX_SIEVE_PRIME) 
   {
-    if ((primeSieve[i>>5] & (1 << (i&0x1f))) == 0)
-    {
-      primeTable[j++] = (i<<1) + 1;
-    }
+    printf("Configuration error, max prime != defined constant\n");
+    exit(-1);
   }
 
-  printf("Initialized prime table, max prime: %d\n", primeTable[PRIME_TABLE_SIZE-1]);
-  if ( primeTable[PRIME_TABLE_SIZE-1] != MAX_SIEVE_PRIME) 
+  for (j = LOW_PRIME_IDX, p = primeAt(j); p < SIEVE_SIZE; p += primeGaps[++j] << 1);
+  sieveSizePrimeIdx = j;
+
+  printf("Prime table uses %uMB (%uMB uncompressed)\n",
+         (unsigned)(PRIME_TABLE_SIZE + sizeof(unsigned int) * PRIME_CHECKPOINTS) >> 20,
+         (unsigned)(sizeof(unsigned int) * PRIME_TABLE_SIZE) >> 20);
+
+  for (unsigned n = 1; n < rh_numaNodes(); ++n)
   {
-    printf("Configuration error, max prime != defined constant\n");
-    exit(-1);
+    nodePrimes[n].gaps = rh_numaAlloc(PRIME_TABLE_SIZE + 1, n);
+    memcpy(nodePrimes[n].gaps, primeGaps, PRIME_TABLE_SIZE + 1);
+    nodePrimes[n].checkpoints = rh_numaAlloc(sizeof(unsigned int) * PRIME_CHECKPOINTS, n);
+    memcpy(nodePrimes[n].checkpoints, primeCheckpoints, sizeof(unsigned int) * PRIME_CHECKPOINTS);
   }
+  if (rh_numaNodes() > 1)
+    printf("Prime table copied to %u nodes\n", rh_numaNodes());
 
   mpz_init_set_ui(primorial, qGenMult[0]);
   for (i = 1; i < sizeof(qGenMult) / sizeof(qGenMult[0]); ++i)
@@ -223,12 +557,11 @@ void rh_oneTimeInit(reportSuccess_t _reportSuccess, checkRestart_t _checkRestart
   //clock_gettime(CLOCK_MONOTONIC, &tv);
   //start = tv.tv_sec + (tv.tv_nsec / 1000000000.0);
 #ifdef MODP_RESULT_DEBUG
-  for (j = FIRST_PRIME_INDEX; j < PRIME_TABLE_SIZE; ++j)
+  for (j = FIRST_PRIME_INDEX, p = primeAt(j); j < PRIME_TABLE_SIZE; p += primeGaps[++j] << 1)
 #else
-  for (j = FIRST_PRIME_INDEX; j < LOW_PRIME_IDX; ++j)
+  for (j = FIRST_PRIME_INDEX, p = lowPrimes[j]; j < LOW_PRIME_IDX; p = lowPrimes[++j])
 #endif
   {
-    unsigned int p = primeTable[j];
     unsigned primmodp = mpz_fdiv_ui(primorial, p);
     primeTableInverses[j] = inverse(primmodp, p);
   }
@@ -236,11 +569,125 @@ void rh_oneTimeInit(reportSuccess_t _reportSuccess, checkRestart_t _checkRestart
   //clock_gettime(CLOCK_MONOTONIC, &tv);
   //end = tv.tv_sec + (tv.tv_nsec / 1000000000.0);
   //printf("Computed inverses in %.3f\n", end - start);
+
+  FILE* statm = fopen("/proc/self/statm", "r");
+  unsigned long pages;
+  if (statm && fscanf(statm, "%*u %lu", &pages) == 1)
+    printf("Resident memory after init: %luMB\n", (pages * sysconf(_SC_PAGESIZE)) >> 20);
+  if (statm) fclose(statm);
+
+  if (testers < 1)
+  {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    testers = cores < 1 ? 1 : cores;
+  }
+  numEngines = _engines < 1 ? 1 : _engines;
+  if (testers < numEngines) testers = numEngines;
+
+  // The testers are shared out between the engines
+  engines = malloc(sizeof(rh_engine_t*) * numEngines);
+  unsigned firstTester = 0;
+  for (i = 0; i < numEngines; ++i)
+  {
+    unsigned engineTesters = testers / numEngines + (i < testers % numEngines);
+    engines[i] = createEngine(i, engineTesters, firstTester);
+    firstTester += engineTesters;
+  }
+
+  // Placement is planned over all the threads before any of them start
+  unsigned* testerNode = malloc(sizeof(unsigned) * testers);
+  unsigned* engineFirstTester = malloc(sizeof(unsigned) * numEngines);
+  for (i = 0; i < numEngines; ++i)
+  {
+    for (j = 0; j < engines[i]->numTesters; ++j)
+      testerNode[engines[i]->firstTester + j] = engines[i]->workerNode[j];
+    engineFirstTester[i] = engines[i]->firstTester;
+  }
+  rh_affinityPlan(testers, testerNode, numEngines, engineFirstTester);
+  free(testerNode);
+  free(engineFirstTester);
+
+  for (i = 0; i < numEngines; ++i)
+    startWorkers(engines[i]);
 }
 // end of init
 
-static modp_indata_t modp_inbuf;
-static modp_outdata_t modp_outbuf;
+void rh_cancelSearches()
+{
+  rh_cancelMove(&searchCancel);
+}
+
+void rh_getAbortLatency(uint64_t* buckets)
+{
+  _Static_assert(RH_ABORT_BUCKETS == RH_CANCEL_BUCKETS, "abort latency buckets");
+  rh_cancelGetLatency(&searchCancel, buckets);
+}
+
+unsigned rh_numEngines()
+{
+  return numEngines;
+}
+
+rh_engine_t* rh_getEngine(unsigned index)
+{
+  return engines[index];
+}
+
+rh_workUnit_t* rh_createWorkUnit()
+{
+  rh_workUnit_t* unit = malloc(sizeof(rh_workUnit_t));
+  mpz_init2(unit->base, RH_MPZ_BITS);
+  mpz_init2(unit->xPlus16057, RH_MPZ_BITS);
+  for (unsigned i = 0; i < 6; ++i)
+    unit->sieveOffsets[i] = malloc(sizeof(unsigned int) * LOW_PRIME_IDX);
+  return unit;
+}
+
+// Finds xPlus16057 and the offsets of the low primes for target.
+// Only reads tables that are constant after rh_oneTimeInit(), so it is safe
+// to call from another thread while a search is running.
+void rh_prepareWorkUnit(rh_workUnit_t* unit, mpz_t target)
+{
+  mpz_set(unit->base, target);
+
+  mpz_fdiv_r(unit->xPlus16057, unit->base, primorial);    // Actually b mod q#
+  mpz_sub(unit->xPlus16057, primorial, unit->xPlus16057); // Now x
+  mpz_add_ui(unit->xPlus16057, unit->xPlus16057, 16057);
+  mpz_add(unit->xPlus16057, unit->base, unit->xPlus16057);
+
+  for (unsigned j = FIRST_PRIME_INDEX; j < LOW_PRIME_IDX; ++j)
+  {
+    // Find b + x + 16057 mod p
+    unsigned p = lowPrimes[j];
+    unsigned qinv = primeTableInverses[j];
+    unsigned result = mpz_fdiv_ui(unit->xPlus16057, p);
+
+    if (result >= p) result -= p;
+    
+    unsigned k = p - mulmod64(result, qinv, p);
+    unsigned qinv2 = qinv << 1;
+    if (qinv2 >= p) qinv2 -= p;
+    unsigned qinv4 = qinv2<< 1;
+    if (qinv4 >= p) qinv4 -= p;
+
+    unit->sieveOffsets[0][j] = k;
+    if (k < qinv4) k += p;
+    k -= qinv4;
+    unit->sieveOffsets[1][j] = k;
+    if (k < qinv2) k += p;
+    k -= qinv2;
+    unit->sieveOffsets[2][j] = k;
+    if (k < qinv4) k += p;
+    k -= qinv4;
+    unit->sieveOffsets[3][j] = k;
+    if (k < qinv2) k += p;
+    k -= qinv2;
+    unit->sieveOffsets[4][j] = k;
+    if (k < qinv4) k += p;
+    k -= qinv4;
+    unit->sieveOffsets[5][j] = k;
+  }
+}
 
 static int epip_waitfor(unsigned row, unsigned col)
 {
@@ -267,206 +714,539 @@ static int epip_waitfor(unsigned row, unsigned col)
   return sleeps;
 }
 
-static void* testThread(void*);
+// Sieves primes [minj, maxj) below SIEVE_SIZE.  The offsets carry from
+// each segment to the next, so a range of primes goes through the
+// segments in order and ranges sieving at the same time take turns on
+// each segment.  Whoever sieves the last prime hands out the tests.
+static void testTask(const rh_task_t* task, unsigned begin, unsigned end, unsigned worker);
 
-static void* lowSieve(void* void_maxj)
+static void sieveTask(const rh_task_t* task, unsigned minj, unsigned maxj, unsigned worker)
 {
-  volatile unsigned* maxjptr = void_maxj;
-  unsigned minj = FIRST_PRIME_INDEX;
-  unsigned maxj = *maxjptr;
+  rh_engine_t* engine = task->arg;
+  unsigned int* sieve = engine->sieve;
+  unsigned int** sieveOffsets = engine->sieveOffsets;
+  if (!engine->firstSieveAt)
+    __atomic_store_n(&engine->firstSieveAt, rh_cancelNow(), __ATOMIC_RELAXED);
+  const primeTable_t* primes = &nodePrimes[engine->workerNode[worker]];
+  for (unsigned l = 0; l < SIEVE_SIZE && !isCancelled(engine); l += SIEVE_SEGMENT_SIZE)
+  {
+    pthread_mutex_lock(&engine->segmentLock[l / SIEVE_SEGMENT_SIZE]);
+    unsigned p = tablePrimeAt(primes, minj);
+    for (unsigned j = minj; j < maxj; p += primes->gaps[++j] << 1)
+    {
+      for (unsigned i = 0; i < 6; ++i)
+      {
+        unsigned k;
+        for (k = sieveOffsets[i][j]; k < SIEVE_SEGMENT_SIZE; k += p)
+        {
+          __builtin_prefetch(&sieve[(l+k+(p<<2))>>5], 0, 1);
+          sieve[(l+k)>>5] |= (1 << ((l+k)&0x1f));
+        }
+        sieveOffsets[i][j] = k - SIEVE_SEGMENT_SIZE;
+      }
+    }
+    pthread_mutex_unlock(&engine->segmentLock[l / SIEVE_SEGMENT_SIZE]);
+  }
+  if (isCancelled(engine)) return;
 
-  while (primeTable[minj] < SIEVE_SIZE)
+  if (__atomic_add_fetch(&engine->lowSievePrimes, maxj - minj, __ATOMIC_ACQ_REL) == sieveSizePrimeIdx - FIRST_PRIME_INDEX)
   {
-          for (unsigned l = 0; l < SIEVE_SIZE && !cancelEverything; l += 2400000)
-          {
-            for (unsigned j = minj; j < maxj; ++j)
-            {
-              unsigned p = primeTable[j];
-              for (unsigned i = 0; i < 6; ++i)
-              {
-                unsigned k;
-                for (k = sieveOffsets[i][j]; k < 2400000; k += p)
-                {
-                  __builtin_prefetch(&sieve[(l+k+(p<<2))>>5], 0, 1);
-                  sieve[(l+k)>>5] |= (1 << ((l+k)&0x1f));
-                }
-                sieveOffsets[i][j] = k - 2400000;
-              }
-            }
-          }
-    if (cancelEverything) break;
-    minj = maxj;
-    while (*maxjptr == maxj);
-    maxj = *maxjptr;
-    while (primeTable[maxj-1] > SIEVE_SIZE) --maxj;
-    //fprintf(stderr, "Low sieved to %d (%d)\n", minj, primeTable[minj]);
+    //fprintf(stderr, "Low sieved to %d (%d)\n", maxj, primeAt(maxj));
+    engine->lowSieveDone = 1;
+
+    // Testing starts now, even though epip hasn't finished sieving.
+    // Each node's first worker gets the node's part of the sieve.
+    for (unsigned n = 0; n < engine->numNodes; ++n)
+    {
+      rh_task_t tests = { testTask, engine, { 0, 0 }, TASK_TEST, engine->nodeSieveBegin[n], engine->nodeSieveEnd[n], TEST_GRAIN };
+      rh_schedPush(&engine->sched, engine->numNodes > 1 ? n : worker, &tests);
+    }
   }
+}
 
-  lowSieveDone = 1;
+static void queueSieve(rh_engine_t* engine, unsigned minj, unsigned maxj)
+{
+  rh_task_t task = { sieveTask, engine, { 0, 0 }, TASK_SIEVE, minj, maxj, SIEVE_GRAIN };
+  rh_schedPush(&engine->sched, engine->feederWorker, &task);
+}
 
-  // Start one tester immediately, even though epip hasn't finished sieving.
-  if (!cancelEverything)
-    pthread_create(&test_tid[0], NULL, testThread, NULL);
+// Zeroes sieve segments [begin, end) of the buffer in param[0]
+static void clearTask(const rh_task_t* task, unsigned begin, unsigned end, unsigned worker)
+{
+  rh_engine_t* engine = task->arg;
+  unsigned buffer = task->param[0];
+  (void)worker;
+  for (unsigned l = begin; l < end; ++l)
+  {
+    memset(&engine->sieves[buffer][(l * SIEVE_SEGMENT_SIZE) >> 5], 0, SIEVE_SEGMENT_SIZE >> 3);
+    memset(&engine->sieveHighPrimes[buffer][(l * SIEVE_SEGMENT_SIZE) >> 5], 0, SIEVE_SEGMENT_SIZE >> 3);
+  }
+}
 
-  return NULL;
+// Hands the sieve the unit used to the workers to clear, a segment at a
+// time on the node it is on, and moves on to the other.  Only called
+// while the workers are idle, and the clear is finished before the
+// next unit ends, so the other is always clear when it is switched to.
+static void recycleSieve(rh_engine_t* engine)
+{
+  unsigned buffer = engine->sieveBuffer;
+  unsigned numNodes = engine->numNodes;
+  for (unsigned n = 0; n < numNodes; ++n)
+  {
+    rh_task_t task = { clearTask, engine, { buffer, 0 }, TASK_CLEAR,
+                       (SIEVE_SEGMENTS * n + numNodes - 1) / numNodes,
+                       (SIEVE_SEGMENTS * (n + 1) + numNodes - 1) / numNodes, 1 };
+    rh_schedPush(&engine->sched, numNodes > 1 ? n : engine->feederWorker, &task);
+  }
+  engine->sieveBuffer = buffer ^ 1;
+  engine->sieve = engine->sieves[buffer ^ 1];
+  engine->sieveHighPrime = engine->sieveHighPrimes[buffer ^ 1];
 }
 
-static void singleTest(unsigned i, mpz_t candidate, mpz_t testpow, mpz_t testres, mpz_t two)
+static inline void markHighPrime(unsigned int* sieveHighPrime, unsigned k)
 {
-        unsigned primes = 0;
+  if (k < SIEVE_SIZE) __atomic_fetch_or(&sieveHighPrime[k>>5], 1u<<(k&0x1f), __ATOMIC_RELAXED);
+}
 
-        mpz_mul_ui(candidate, primorial, i);
-        mpz_add(candidate, candidate, xPlus16057);
+// Marks the six offsets of each prime from j in sieveHighPrime
+static void markHighPrimes(unsigned int* sieveHighPrime, const unsigned char* gaps, unsigned j, unsigned p, const modp_result_t* result, unsigned count)
+{
+  for (unsigned i = 0; i < count; ++i, p += gaps[++j] << 1)
+  {
+    unsigned k = p - result[i].r;
+    unsigned qinv2 = result[i].twoqinv;
+    unsigned qinv4 = qinv2<< 1;
+    if (qinv4 >= p) qinv4 -= p;
 
-        //gmp_printf("Candidate: %Zd\n", candidate);
-        mpz_sub_ui(testpow, candidate, 1);
-        mpz_powm(testres, two, testpow, candidate);
-        if (mpz_cmp_ui(testres, 1) == 0) primes++;
-        if (primes < 1) return;
+    markHighPrime(sieveHighPrime, k);
+    if (k < qinv4) k += p;
+    k -= qinv4;
+    markHighPrime(sieveHighPrime, k);
+    if (k < qinv2) k += p;
+    k -= qinv2;
+    markHighPrime(sieveHighPrime, k);
+    if (k < qinv4) k += p;
+    k -= qinv4;
+    markHighPrime(sieveHighPrime, k);
+    if (k < qinv2) k += p;
+    k -= qinv2;
+    markHighPrime(sieveHighPrime, k);
+    if (k < qinv4) k += p;
+    k -= qinv4;
+    markHighPrime(sieveHighPrime, k);
+  }
+}
 
-        mpz_add_ui(testpow, testpow, 4);
-        mpz_add_ui(candidate, candidate, 4);
-        mpz_powm(testres, two, testpow, candidate);
-        if (mpz_cmp_ui(testres, 1) == 0) primes++;
+static void highPrimeTask(const rh_task_t* task, unsigned begin, unsigned end, unsigned worker)
+{
+  highPrimePage_t* page = task->arg;
+  rh_engine_t* engine = page->engine;
+  if (!isCancelled(engine))
+    markHighPrimes(engine->sieveHighPrime, nodePrimes[engine->workerNode[worker]].gaps,
+                   page->j, page->p, page->result + begin, end - begin);
+
+  pthread_mutex_lock(&engine->highPrimePageLock);
+  engine->freeHighPrimePages[engine->numFreeHighPrimePages++] = page;
+  pthread_mutex_unlock(&engine->highPrimePageLock);
+}
 
-        mpz_add_ui(testpow, testpow, 2);
-        mpz_add_ui(candidate, candidate, 2);
-        mpz_powm(testres, two, testpow, candidate);
-        if (mpz_cmp_ui(testres, 1) == 0) primes++;
+// Queues the results in modp_outbuf, returning 0 if all the pages are in use
+static int queueHighPrimes(rh_engine_t* engine, unsigned j, unsigned p)
+{
+  highPrimePage_t* page = NULL;
+  pthread_mutex_lock(&engine->highPrimePageLock);
+  if (engine->numFreeHighPrimePages > 0)
+    page = engine->freeHighPrimePages[--engine->numFreeHighPrimePages];
+  pthread_mutex_unlock(&engine->highPrimePageLock);
+  if (!page) return 0;
+
+  const modp_outdata_t* out = &engine->modp_outbuf;
+  page->j = j;
+  page->p = p;
+  memcpy(page->result, out->result, sizeof(modp_result_t) * out->num_results);
+  rh_task_t task = { highPrimeTask, page, { 0, 0 }, TASK_HIGH_PRIMES, 0, out->num_results, out->num_results };
+  rh_schedPush(&engine->sched, engine->feederWorker, &task);
+  return 1;
+}
 
-        mpz_add_ui(testpow, testpow, 4);
-        mpz_add_ui(candidate, candidate, 4);
-        mpz_powm(testres, two, testpow, candidate);
-        if (mpz_cmp_ui(testres, 1) == 0) primes++;
-        if (primes < 2) return;
+// Base 2 Fermat test of candidate
+static int isFermatPrime(rh_engine_t* engine, mpz_t candidate, mpz_t testpow, mpz_t testres, mpz_t two)
+{
+  // A carry can make the odd candidate a limb longer than xPlus16057
+  if (engine->fermatTest && mpz_size(candidate) == (size_t)engine->fermatLimbs)
+    return engine->fermatTest(candidate->_mp_d);
 
-        mpz_add_ui(testpow, testpow, 2);
-        mpz_add_ui(candidate, candidate, 2);
-        mpz_powm(testres, two, testpow, candidate);
-        if (mpz_cmp_ui(testres, 1) == 0) primes++;
+  mpz_sub_ui(testpow, candidate, 1);
+  mpz_powm(testres, two, testpow, candidate);
+  return mpz_cmp_ui(testres, 1) == 0;
+}
 
-        if (primes >= 3)
-        {
-          mpz_add_ui(testpow, testpow, 4);
-          mpz_add_ui(candidate, candidate, 4);
-          mpz_powm(testres, two, testpow, candidate);
-          if (mpz_cmp_ui(testres, 1) == 0) primes++;
+// Tuple members are tested in stages, in each engine's memberOrder.
+// Member 0 always comes first as tuples are only reported if it is prime;
+// the others are ordered to fail as early as possible, from the pass
+// rates seen so far by all the engines.
+static const unsigned memberOffset[TUPLE_MEMBERS] = { 0, 4, 6, 10, 12, 16 };
+#define MIN_ORDER_SAMPLES 1000 // Tests of each member before reordering
 
-          mpz_sub_ui(candidate, candidate, 16);
-        }
-	else
-	{
-	  mpz_sub_ui(candidate, candidate, 12);
-	}
+// Counted by stage for the funnel statistics, and by member for the order
+static void countTests(rh_engine_t* engine, unsigned stage, unsigned tested, unsigned passed)
+{
+  unsigned member = engine->memberOrder[stage];
+  rh_statsAdd(RH_STAT_STAGE_TESTED + stage, tested);
+  rh_statsAdd(RH_STAT_STAGE_PASSED + stage, passed);
+  rh_statsAdd(RH_STAT_MEMBER_TESTED + member, tested);
+  rh_statsAdd(RH_STAT_MEMBER_PASSED + member, passed);
+}
 
-        reportSuccess(candidate, primes);
+// Whether a candidate with primes found after testing stage should go on
+// to the next.  Once member 0 or three others have failed it can't be a
+// share.  Whenever testing stops, tuples with at least 2 primes are reported.
+static int continueTesting(unsigned stage, unsigned primes)
+{
+  return primes > 0 && stage + 1 - primes < 3 && stage + 1 < TUPLE_MEMBERS;
 }
 
-// Assumes hash, primorial, trailingBits are set.
-// Re-inits sieve, finds xPlus16057 and inits offsets.
-static void initSieve()
+// Expected tests for a candidate that passed member 0, if the members
+// are tested in order
+static double expectedTests(const unsigned* order, const double* passRate)
 {
-  int i, j;
-  struct timespec sleeptime;
-  sleeptime.tv_sec = 0;
-  sleeptime.tv_nsec = 10000;
+  // Probability of still testing with 0, 1 or 2 failures
+  double failures[3] = { 1, 0, 0 };
+  double tests = 1;
+  for (unsigned stage = 1; stage < TUPLE_MEMBERS; ++stage)
+  {
+    double p = passRate[order[stage]];
+    tests += failures[0] + failures[1] + failures[2];
+    failures[2] = failures[2] * p + failures[1] * (1 - p);
+    failures[1] = failures[1] * p + failures[0] * (1 - p);
+    failures[0] = failures[0] * p;
+  }
+  return tests;
+}
 
-  //printf("Load epiphany with x mod p program\n");
-  e_load_group(EPIP_SREC_DIR "e_modp.srec", &epip_dev, 0, 0, epip_platform.rows, epip_platform.cols, E_FALSE);
+// Steps order[first..n) to the next lexicographic permutation, returning 0
+// after the last
+static int nextPermutation(unsigned* order, unsigned first, unsigned n)
+{
+  unsigned i = n - 1;
+  while (i > first && order[i-1] > order[i]) --i;
+  if (i == first) return 0;
+  unsigned j = n - 1;
+  while (order[j] < order[i-1]) --j;
+  unsigned t = order[i-1]; order[i-1] = order[j]; order[j] = t;
+  for (j = n - 1; i < j; ++i, --j)
+  {
+    t = order[i]; order[i] = order[j]; order[j] = t;
+  }
+  return 1;
+}
+
+// Picks the order of members 1-5 with the fewest expected tests, given
+// their pass rates so far.  Must not be called while the engine's testers
+// are running.
+static void chooseMemberOrder(rh_engine_t* engine)
+{
+  unsigned* memberOrder = engine->memberOrder;
+  double passRate[TUPLE_MEMBERS];
+  for (unsigned member = 1; member < TUPLE_MEMBERS; ++member)
+  {
+    uint64_t tested = rh_statsGet(RH_STAT_MEMBER_TESTED + member);
+    if (tested < MIN_ORDER_SAMPLES) return;
+    passRate[member] = (double)rh_statsGet(RH_STAT_MEMBER_PASSED + member) / tested;
+  }
 
-  memset(sieve, 0, SIEVE_SIZE>>3);
-  memset(sieveHighPrime, 0, SIEVE_SIZE>>3);
-  nextSieveIdx = START_BLOCK*SIEVE_BLOCK_SIZE;
+  unsigned order[TUPLE_MEMBERS] = { 0, 1, 2, 3, 4, 5 };
+  unsigned best[TUPLE_MEMBERS];
+  double bestTests = 0;
+  do
+  {
+    double tests = expectedTests(order, passRate);
+    if (bestTests == 0 || tests < bestTests)
+    {
+      bestTests = tests;
+      memcpy(best, order, sizeof(best));
+    }
+  } while (nextPermutation(order, 1, TUPLE_MEMBERS));
+
+  if (memcmp(best, memberOrder, sizeof(best)) != 0)
+  {
+    memcpy(memberOrder, best, sizeof(best));
+    printf("Tuple test order now +%u +%u +%u +%u +%u +%u (%.3f tests per member 0 prime)\n",
+           memberOffset[best[0]], memberOffset[best[1]], memberOffset[best[2]],
+           memberOffset[best[3]], memberOffset[best[4]], memberOffset[best[5]], bestTests);
+  }
+}
+
+static void singleTest(rh_engine_t* engine, unsigned i, mpz_t candidate, mpz_t testpow, mpz_t testres, mpz_t two)
+{
+  unsigned primes = 0;
+
+  for (unsigned stage = 0; stage < TUPLE_MEMBERS; ++stage)
+  {
+    mpz_mul_ui(candidate, primorial, i);
+    mpz_add(candidate, candidate, engine->xPlus16057);
+    mpz_add_ui(candidate, candidate, memberOffset[engine->memberOrder[stage]]);
+
+    //gmp_printf("Candidate: %Zd\n", candidate);
+    int prime = isFermatPrime(engine, candidate, testpow, testres, two);
+    countTests(engine, stage, 1, prime);
+    if (prime) primes++;
+    if (!continueTesting(stage, primes)) break;
+  }
+
+  if (primes >= 2)
+  {
+    mpz_mul_ui(candidate, primorial, i);
+    mpz_add(candidate, candidate, engine->xPlus16057);
+    reportSuccess(engine->context, candidate, primes);
+  }
+}
+
+// Runs a Fermat test over count candidates, in a single batch for
+// those that are the expected size.
+static void batchStage(rh_engine_t* engine, mpz_t* candidates, unsigned count, int* results,
+                       mpz_t testpow, mpz_t testres, mpz_t two)
+{
+  mp_srcptr numbers[RH_FERMAT_MAX_LANES];
+  unsigned batched[RH_FERMAT_MAX_LANES];
+  int batchResults[RH_FERMAT_MAX_LANES];
+  unsigned n = 0;
+
+  for (unsigned k = 0; k < count; ++k)
+  {
+    if (engine->fermatBatch && mpz_size(candidates[k]) == (size_t)engine->fermatLimbs)
+    {
+      numbers[n] = candidates[k]->_mp_d;
+      batched[n++] = k;
+    }
+    else
+    {
+      results[k] = isFermatPrime(engine, candidates[k], testpow, testres, two);
+    }
+  }
+
+  if (n > 0)
+  {
+    engine->fermatBatch(numbers, engine->fermatLimbs, n, batchResults);
+    for (unsigned k = 0; k < n; ++k)
+      results[batched[k]] = batchResults[k];
+  }
+}
+
+static void pipelineInit(tuplePipeline_t* pl)
+{
+  memset(pl->count, 0, sizeof(pl->count));
+  for (unsigned k = 0; k < RH_FERMAT_MAX_LANES; ++k)
+    mpz_init2(pl->candidates[k], RH_MPZ_BITS);
+  mpz_init2(pl->report, RH_MPZ_BITS);
+  mpz_init2(pl->testpow, RH_MPZ_BITS);
+  mpz_init2(pl->testres, RH_MPZ_BITS);
+  mpz_init_set_ui(pl->two, 2);
+}
+
+// Sets the pipeline up for the kernels chosen for the current unit
+static void pipelineStart(rh_engine_t* engine, tuplePipeline_t* pl)
+{
+  pl->batchSize = engine->fermatBatch ? engine->fermatLanes : RH_FERMAT_MAX_LANES;
+}
+
+// Drops anything left queued by a cancelled unit
+static void pipelineReset(tuplePipeline_t* pl)
+{
+  for (unsigned stage = 0; stage < TUPLE_MEMBERS; ++stage)
+  {
+    rh_statsAdd(RH_STAT_STAGE_QUEUED + stage, -(uint64_t)pl->count[stage]);
+    pl->count[stage] = 0;
+  }
+}
+
+static void pipelinePush(rh_engine_t* engine, tuplePipeline_t* pl, unsigned stage, unsigned i, unsigned primes);
+
+// Tests a stage over the candidates queued for it, passing them on to
+// the next stage or reporting them.
+static void pipelineRun(rh_engine_t* engine, tuplePipeline_t* pl, unsigned stage)
+{
+  unsigned is[RH_FERMAT_MAX_LANES], primes[RH_FERMAT_MAX_LANES];
+  int results[RH_FERMAT_MAX_LANES];
+  unsigned count = pl->count[stage];
+  memcpy(is, pl->is[stage], sizeof(unsigned) * count);
+  memcpy(primes, pl->primes[stage], sizeof(unsigned) * count);
+  pl->count[stage] = 0;
+  rh_statsAdd(RH_STAT_STAGE_QUEUED + stage, -(uint64_t)count);
+
+  for (unsigned k = 0; k < count; ++k)
+  {
+    mpz_mul_ui(pl->candidates[k], primorial, is[k]);
+    mpz_add(pl->candidates[k], pl->candidates[k], engine->xPlus16057);
+    mpz_add_ui(pl->candidates[k], pl->candidates[k], memberOffset[engine->memberOrder[stage]]);
+  }
+  batchStage(engine, pl->candidates, count, results, pl->testpow, pl->testres, pl->two);
+
+  unsigned passed = 0;
+  for (unsigned k = 0; k < count; ++k)
+  {
+    if (results[k])
+    {
+      primes[k]++;
+      passed++;
+    }
+  }
+  countTests(engine, stage, count, passed);
+
+  // Passing candidates on can run the next stage's batch, reusing
+  // pl->candidates, so reports are recomputed from is.
+  for (unsigned k = 0; k < count; ++k)
+  {
+    if (continueTesting(stage, primes[k]))
+    {
+      pipelinePush(engine, pl, stage+1, is[k], primes[k]);
+    }
+    else if (primes[k] >= 2)
+    {
+      mpz_mul_ui(pl->report, primorial, is[k]);
+      mpz_add(pl->report, pl->report, engine->xPlus16057);
+      reportSuccess(engine->context, pl->report, primes[k]);
+    }
+  }
+}
+
+static void pipelinePush(rh_engine_t* engine, tuplePipeline_t* pl, unsigned stage, unsigned i, unsigned primes)
+{
+  unsigned n = pl->count[stage]++;
+  pl->is[stage][n] = i;
+  pl->primes[stage][n] = primes;
+  rh_statsInc(RH_STAT_STAGE_QUEUED + stage);
+  if (n + 1 == pl->batchSize)
+    pipelineRun(engine, pl, stage);
+}
+
+// Runs the partial batches left at the end of a search
+static void pipelineFlush(rh_engine_t* engine, tuplePipeline_t* pl)
+{
+  for (unsigned stage = 0; stage < TUPLE_MEMBERS; ++stage)
+    if (pl->count[stage] > 0)
+      pipelineRun(engine, pl, stage);
+}
+
+unsigned rh_getNodeStats(rh_nodeStats_t* stats)
+{
+  unsigned nodes = 0;
+  for (unsigned n = 0; n < RH_NUMA_MAX_NODES; ++n)
+  {
+    stats[n].workers = nodeWorkers[n];
+    stats[n].scanned = rh_statsGetNode(RH_STAT_SCANNED, n);
+    stats[n].candidates = rh_statsGetNode(RH_STAT_SURVIVORS, n);
+    if (nodeWorkers[n]) nodes = n + 1;
+  }
+  return nodes;
+}
 
-  mpz_fdiv_r(xPlus16057, base, primorial);     // Actually b mod q#
-  mpz_sub(xPlus16057, primorial, xPlus16057);  // Now x
-  mpz_add_ui(xPlus16057, xPlus16057, 16057);
-  mpz_add(xPlus16057, base, xPlus16057);
+void rh_getStageStats(rh_stageStats_t* stats)
+{
+  for (unsigned stage = 0; stage < TUPLE_MEMBERS; ++stage)
+  {
+    stats[stage].offset = memberOffset[numEngines ? engines[0]->memberOrder[stage] : stage];
+    // Slots are read at different times, so the sum can briefly dip below 0
+    int64_t queued = (int64_t)rh_statsGet(RH_STAT_STAGE_QUEUED + stage);
+    stats[stage].queued = queued > 0 ? (unsigned)queued : 0;
+    stats[stage].tested = rh_statsGet(RH_STAT_STAGE_TESTED + stage);
+    stats[stage].passed = rh_statsGet(RH_STAT_STAGE_PASSED + stage);
+  }
+}
+
+// Fills the Epiphany's bit sieve of the odd numbers from pbase, which is one
+// more than a multiple of 64, from the prime table at *pj (the prime *pp) on.
+// Bits are set for composites.  Returns the number of primes in the window.
+static unsigned modpSieveWindow(unsigned pbase, unsigned* sieve, unsigned* pj, unsigned* pp)
+{
+  unsigned end = pbase + (MODP_E_SIEVE_SIZE<<1);
+  unsigned j = *pj, p = *pp, count = 0;
+  memset(sieve, 0xff, MODP_E_SIEVE_SIZE>>3);
+  for (; j < PRIME_TABLE_SIZE && p < end; p += primeGaps[++j] << 1, ++count)
+  {
+    unsigned i = (p - pbase) >> 1;
+    sieve[i>>5] &= ~(1u << (i&0x1f));
+  }
+  *pj = j;
+  *pp = p;
+  return count;
+}
 
-  modp_inbuf.nn = mpz_size(xPlus16057);
-  memcpy(modp_inbuf.n, xPlus16057->_mp_d, sizeof(mp_limb_t)*modp_inbuf.nn);
+// Re-inits sieve and offsets from a prepared work unit.
+static void initSieve(rh_engine_t* engine, rh_workUnit_t* unit)
+{
+  int i, j;
+  unsigned int* sieve = engine->sieve;
+  unsigned int* sieveHighPrime = engine->sieveHighPrime;
+  unsigned int** sieveOffsets = engine->sieveOffsets;
+  modp_indata_t* modp_inbuf = &engine->modp_inbuf;
+  modp_outdata_t* modp_outbuf = &engine->modp_outbuf;
+
+  // The sieve is already clear, and the low primes' offsets come with
+  // the unit, so the workers start sieving before anything else
+  mpz_set(engine->xPlus16057, unit->xPlus16057);
 
   struct timespec tv;
   double start, end;
   clock_gettime(CLOCK_MONOTONIC, &tv);
   start = tv.tv_sec + (tv.tv_nsec / 1000000000.0);
-  for (j = FIRST_PRIME_INDEX; j < LOW_PRIME_IDX; ++j)
-  {
-    // Find b + x + 16057 mod p
-    unsigned p = primeTable[j];
-    unsigned qinv = primeTableInverses[j];
-    unsigned result = mpz_fdiv_ui(xPlus16057, p);
+  for (i = 0; i < 6; ++i)
+    memcpy(&sieveOffsets[i][FIRST_PRIME_INDEX], &unit->sieveOffsets[i][FIRST_PRIME_INDEX], sizeof(unsigned) * (LOW_PRIME_IDX - FIRST_PRIME_INDEX));
+  j = LOW_PRIME_IDX;
 
-    if (result >= p) result -= p;
-    
-    unsigned k = p - mulmod64(result, qinv, p);
-    unsigned qinv2 = qinv << 1;
-    if (qinv2 >= p) qinv2 -= p;
-    unsigned qinv4 = qinv2<< 1;
-    if (qinv4 >= p) qinv4 -= p;
+  //printf("Low sieve initialized to %d (j=%d)\n", primeAt(j), j);
+  engine->lowSieveDone = 0;
+  engine->lowSievePrimes = 0;
+  engine->testsLeft = SIEVE_SIZE - START_BLOCK*SIEVE_BLOCK_SIZE;
 
-    sieveOffsets[0][j] = k;
-    if (k < qinv4) k += p;
-    k -= qinv4;
-    sieveOffsets[1][j] = k;
-    if (k < qinv2) k += p;
-    k -= qinv2;
-    sieveOffsets[2][j] = k;
-    if (k < qinv4) k += p;
-    k -= qinv4;
-    sieveOffsets[3][j] = k;
-    if (k < qinv2) k += p;
-    k -= qinv2;
-    sieveOffsets[4][j] = k;
-    if (k < qinv4) k += p;
-    k -= qinv4;
-    sieveOffsets[5][j] = k;
-  }
+  // The low sieve is queued as the Epiphany finds offsets for each range of primes
+  queueSieve(engine, FIRST_PRIME_INDEX, LOW_PRIME_IDX);
+  unsigned sievedTo = LOW_PRIME_IDX;
 
-  //printf("Low sieve initialized to %d (j=%d)\n", primeTable[j], j);
-  lowSieveDone = 0;
+  // Held until the Epiphany has found all the offsets
+  pthread_mutex_lock(&epipLock);
 
-  pthread_t lowsievethread;
-  pthread_create(&lowsievethread, NULL, lowSieve, &j);
+  //printf("Load epiphany with x mod p program\n");
+  e_load_group(EPIP_SREC_DIR "e_modp.srec", &epip_dev, 0, 0, epip_platform.rows, epip_platform.cols, E_FALSE);
+
+  modp_inbuf->nn = mpz_size(engine->xPlus16057);
+  memcpy(modp_inbuf->n, engine->xPlus16057->_mp_d, sizeof(mp_limb_t)*modp_inbuf->nn);
 
-  mpz_t candidate, testpow, testres, two;
-  mpz_init(candidate);
-  mpz_init(testpow);
-  mpz_init(testres);
-  mpz_init_set_ui(two, 2);
+  // The feeder's pipeline is idle until the tests, so its numbers are free
+  tuplePipeline_t* pl = &engine->pipelines[engine->feederWorker];
+  mpz_ptr candidate = pl->candidates[0], testpow = pl->testpow, testres = pl->testres, two = pl->two;
   unsigned testi = 0;
 
-  unsigned pbase = primeTable[j] - (primeTable[j] & 0x3e);
+  unsigned pbase = primeAt(j) - (primeAt(j) & 0x3e);
+
+  // The windows are rebuilt from the prime table, starting from the first
+  // prime in the first of them
+  unsigned windowj = j;
+  while (windowj > 0 && primeAt(windowj-1) >= pbase) --windowj;
+  unsigned windowp = primeAt(windowj);
   while (pbase + (MODP_E_SIEVE_SIZE<<(1+4)) < MAX_SIEVE_PRIME)
   {
     unsigned corej[17];
+    unsigned corep[16];
     corej[0] = j;
     for (unsigned core = 0; core < 16; ++core)
     {
-      modp_inbuf.pbase = pbase;
+      modp_inbuf->pbase = pbase;
+      corep[core] = primeAt(corej[core]);
       corej[core+1] = corej[core];
       pbase += MODP_E_SIEVE_SIZE<<1;
 
-      // Memcpy manually doing a popcount to determine how many primes
-      // are in this section of sieve.
-      unsigned sieveOffset = modp_inbuf.pbase>>6;
-      for (unsigned k = 0; k < MODP_E_SIEVE_SIZE>>5; ++k)
-      {
-        // Probably faster using NEON
-        unsigned sieveVal = primeSieve[sieveOffset+k];
-        corej[core+1] += 32 - __builtin_popcount(sieveVal);
-        modp_inbuf.sieve[k] = sieveVal;
-      }
+      corej[core+1] += modpSieveWindow(modp_inbuf->pbase, modp_inbuf->sieve, &windowj, &windowp);
   
       unsigned status = 0;
 
-      e_write(&epip_mem, 0, 0, EPIP_MODP_IN_OFFSET(core), &modp_inbuf, sizeof(modp_indata_t));
+      e_write(&epip_mem, 0, 0, EPIP_MODP_IN_OFFSET(core), modp_inbuf, sizeof(modp_indata_t));
       e_write(&epip_mem, 0, 0, EPIP_MODP_OUT_OFFSET(core,0), &status, sizeof(unsigned));
       e_write(&epip_mem, 0, 0, EPIP_MODP_OUT_OFFSET(core,1), &status, sizeof(unsigned));
       e_start(&epip_dev, core>>2, core&3);
     }
 
-    if (lowSieveDone)
+    if (engine->lowSieveDone)
     {
       //fprintf(stderr, "T");
       for (; testi < START_BLOCK*SIEVE_BLOCK_SIZE; ++testi)
@@ -474,7 +1254,7 @@ static void initSieve()
         if (((sieve[testi>>5] & (1<<(testi&0x1f))) == 0) &&
             ((sieveHighPrime[testi>>5] & (1<<(testi&0x1f))) == 0))
         {
-          singleTest(testi, candidate, testpow, testres, two);
+          singleTest(engine, testi, candidate, testpow, testres, two);
           ++testi;
           break;
         }
@@ -495,46 +1275,57 @@ static void initSieve()
           e_read(&epip_mem, 0, 0, EPIP_MODP_OUT_OFFSET(core,buf), &status, sizeof(unsigned));
           if (status == 2) break;
 
-          nanosleep(&sleeptime, NULL);
+          if (rh_cancelSleep(&searchCancel, engine->epoch, 10))
+          {
+            pthread_mutex_unlock(&epipLock);
+            return;
+          }
 
           if (++sleeps > 1000000)
           {
             // Seen this once in over 50 hours.  Cancel everything and break out.
             printf("Error: Core %d stuck while sieving\n", core);
 	    exit(-1);
-            cancelEverything = 1;
-            pthread_join(lowsievethread, NULL);
+            engine->cancelEverything = 1;
+            pthread_mutex_unlock(&epipLock);
             return;
           }
         } while(1);
     
-        e_read(&epip_mem, 0, 0, EPIP_MODP_OUT_OFFSET(core,buf), &modp_outbuf, 8);
-        e_read(&epip_mem, 0, 0, EPIP_MODP_OUT_OFFSET(core,buf)+8, &modp_outbuf.result[0], modp_outbuf.num_results*sizeof(modp_result_t));
+        e_read(&epip_mem, 0, 0, EPIP_MODP_OUT_OFFSET(core,buf), modp_outbuf, 8);
+        e_read(&epip_mem, 0, 0, EPIP_MODP_OUT_OFFSET(core,buf)+8, &modp_outbuf->result[0], modp_outbuf->num_results*sizeof(modp_result_t));
         status = 0;
         e_write(&epip_mem, 0, 0, EPIP_MODP_OUT_OFFSET(core,buf), &status, sizeof(unsigned));
         e_start(&epip_dev, core>>2, core&3);
 #ifdef MODP_RESULT_DEBUG
-        printf("Read from core %d buf %d firstp=%d\n", core, buf, modp_outbuf.result[0].p);
+        printf("Read from core %d buf %d firstp=%d\n", core, buf, modp_outbuf->result[0].p);
 #endif
  
-        unsigned endj = corej[core] + modp_outbuf.num_results;
-        for (i = 0; corej[core] < endj; ++i, ++corej[core])
+        unsigned endj = corej[core] + modp_outbuf->num_results;
+#ifndef MODP_RESULT_DEBUG
+        if (corep[core] >= SIEVE_SIZE && queueHighPrimes(engine, corej[core], corep[core]))
+        {
+          for (; corej[core] < endj; corep[core] += primeGaps[++corej[core]] << 1);
+        }
+        else
+#endif
+        for (i = 0; corej[core] < endj; ++i, corep[core] += primeGaps[++corej[core]] << 1)
         {
           // Find b + x + 16057 mod p
-          unsigned p = primeTable[corej[core]];
+          unsigned p = corep[core];
 #ifdef MODP_RESULT_DEBUG
           unsigned q = mpz_fdiv_ui(primorial, p);
           unsigned qinv = primeTableInverses[corej[core]];
-          unsigned result = mpz_fdiv_ui(xPlus16057, p);
+          unsigned result = mpz_fdiv_ui(engine->xPlus16057, p);
           unsigned invresult = mulmod64(result, qinv, p);
 
           if (result >= p) result -= p;
-          if (p != modp_outbuf.result[i].p) printf("Bad p: p=%d should be %d (core %d)\n", modp_outbuf.result[i].p, p, core);
-          if (q != modp_outbuf.result[i].q) printf("Bad q: q=%d should be %d p=%d/%d (core %d)\n", modp_outbuf.result[i].q, q, modp_outbuf.result[i].p, p, core);
-          if (result != modp_outbuf.result[i].x) printf("Bad x: x=%d should be %d p=%d/%d (core %d)\n", modp_outbuf.result[i].x, result, modp_outbuf.result[i].p, p, core);
-          if (invresult != modp_outbuf.result[i].r) printf("Bad r: r=%d should be %d p=%d/%d (core %d)\n", modp_outbuf.result[i].r, invresult, modp_outbuf.result[i].p, p, core);
+          if (p != modp_outbuf->result[i].p) printf("Bad p: p=%d should be %d (core %d)\n", modp_outbuf->result[i].p, p, core);
+          if (q != modp_outbuf->result[i].q) printf("Bad q: q=%d should be %d p=%d/%d (core %d)\n", modp_outbuf->result[i].q, q, modp_outbuf->result[i].p, p, core);
+          if (result != modp_outbuf->result[i].x) printf("Bad x: x=%d should be %d p=%d/%d (core %d)\n", modp_outbuf->result[i].x, result, modp_outbuf->result[i].p, p, core);
+          if (invresult != modp_outbuf->result[i].r) printf("Bad r: r=%d should be %d p=%d/%d (core %d)\n", modp_outbuf->result[i].r, invresult, modp_outbuf->result[i].p, p, core);
 #else
-          unsigned invresult = modp_outbuf.result[i].r;
+          unsigned invresult = modp_outbuf->result[i].r;
 #endif
 
           unsigned k = p - invresult;
@@ -543,9 +1334,9 @@ static void initSieve()
           unsigned qinv2 = qinv << 1;
           if (qinv2 >= p) qinv2 -= p;
 
-          if (qinv2 != modp_outbuf.result[i].twoqinv) printf("Bad qinv2: %d should be %d p=%d\n", modp_outbuf.result[i].twoqinv, qinv2, p);
+          if (qinv2 != modp_outbuf->result[i].twoqinv) printf("Bad qinv2: %d should be %d p=%d\n", modp_outbuf->result[i].twoqinv, qinv2, p);
 #else
-          unsigned qinv2 = modp_outbuf.result[i].twoqinv;
+          unsigned qinv2 = modp_outbuf->result[i].twoqinv;
 #endif
           unsigned qinv4 = qinv2<< 1;
           if (qinv4 >= p) qinv4 -= p;
@@ -571,234 +1362,453 @@ static void initSieve()
           }
           else
           {
-            if (k < SIEVE_SIZE) sieveHighPrime[k>>5] |= 1<<(k&0x1f);
+            markHighPrime(sieveHighPrime, k);
             if (k < qinv4) k += p;
             k -= qinv4;
-            if (k < SIEVE_SIZE) sieveHighPrime[k>>5] |= 1<<(k&0x1f);
+            markHighPrime(sieveHighPrime, k);
             if (k < qinv2) k += p;
             k -= qinv2;
-            if (k < SIEVE_SIZE) sieveHighPrime[k>>5] |= 1<<(k&0x1f);
+            markHighPrime(sieveHighPrime, k);
             if (k < qinv4) k += p;
             k -= qinv4;
-            if (k < SIEVE_SIZE) sieveHighPrime[k>>5] |= 1<<(k&0x1f);
+            markHighPrime(sieveHighPrime, k);
             if (k < qinv2) k += p;
             k -= qinv2;
-            if (k < SIEVE_SIZE) sieveHighPrime[k>>5] |= 1<<(k&0x1f);
+            markHighPrime(sieveHighPrime, k);
             if (k < qinv4) k += p;
             k -= qinv4;
-            if (k < SIEVE_SIZE) sieveHighPrime[k>>5] |= 1<<(k&0x1f);
+            markHighPrime(sieveHighPrime, k);
           }
         }
-        if (modp_outbuf.num_results != MODP_RESULTS_PER_PAGE) 
+        if (modp_outbuf->num_results != MODP_RESULTS_PER_PAGE) 
         {
           //printf("Core %d complete\n", core);
           coredone |= 1<<core;
         }
       }
-      if (checkRestart())
+      if (isCancelled(engine))
       {
-        cancelEverything = 1;
-        pthread_join(lowsievethread, NULL);
+        pthread_mutex_unlock(&epipLock);
         return;
       }
       if (coredone==0xffff) 
       {
         j = corej[15];
+        if (sievedTo < sieveSizePrimeIdx)
+        {
+          unsigned maxj = (unsigned)j < sieveSizePrimeIdx ? (unsigned)j : sieveSizePrimeIdx;
+          queueSieve(engine, sievedTo, maxj);
+          sievedTo = maxj;
+        }
         //fprintf(stderr, ".");
-        //printf("Done to j=%d p=%d\n", j, primeTable[j]);
+        //printf("Done to j=%d p=%d\n", j, primeAt(j));
         break;
       }
     }
   }
 
-  pthread_join(lowsievethread, NULL);
+  pthread_mutex_unlock(&epipLock);
+
+  // Help with the low sieve until it has handed out the tests
+  while (!engine->lowSieveDone && !isCancelled(engine))
+  {
+    unsigned generation = rh_schedGeneration(&engine->sched);
+    if (!rh_schedRun(&engine->sched, engine->feederWorker, TASK_SIEVE | TASK_HIGH_PRIMES))
+      rh_schedWait(&engine->sched, engine->feederWorker, generation);
+  }
 
   //exit(0);
 
   clock_gettime(CLOCK_MONOTONIC, &tv);
   end = tv.tv_sec + (tv.tv_nsec / 1000000000.0);
-  printf("Sieved in %.3f\n", end - start);
+  if (engine->lastTestsDone && engine->firstSieveAt > engine->lastTestsDone)
+    printf("Sieved in %.3f (%.1fM primes/s, started %.2fms after the last unit)\n", end - start, (j - FIRST_PRIME_INDEX) / (1000000.0 * (end - start)),
+           (engine->firstSieveAt - engine->lastTestsDone) / 1000000.0);
+  else
+    printf("Sieved in %.3f (%.1fM primes/s)\n", end - start, (j - FIRST_PRIME_INDEX) / (1000000.0 * (end - start)));
 
   for (; testi < START_BLOCK*SIEVE_BLOCK_SIZE; ++testi)
   {
+    if ((testi & 0xff) == 0 && isCancelled(engine)) break;
     if (((sieve[testi>>5] & (1<<(testi&0x1f))) == 0) &&
         ((sieveHighPrime[testi>>5] & (1<<(testi&0x1f))) == 0))
     {
       fprintf(stderr, "T");
-      singleTest(testi, candidate, testpow, testres, two);
+      singleTest(engine, testi, candidate, testpow, testres, two);
     }
   }
   //printf("Finished first block on sieve thread\n");
-  mpz_clear(candidate);
-  mpz_clear(testpow);
-  mpz_clear(testres);
-  mpz_clear(two);
 }
 
-static void* testThread(__attribute__ ((unused)) void* unused)
-{
-  mpz_t candidate, testpow, testres, two;
-  mpz_init(candidate);
-  mpz_init(testpow);
-  mpz_init(testres);
-  mpz_init_set_ui(two, 2);
+// Tests sieve survivors in [begin, end), on the Epiphany for the feeder
+static void epipFeed(rh_engine_t* engine, unsigned begin, unsigned end);
 
-  while (1)
+static void testTask(const rh_task_t* task, unsigned begin, unsigned end, unsigned worker)
+{
+  rh_engine_t* engine = task->arg;
+  if (__atomic_sub_fetch(&engine->testsLeft, end - begin, __ATOMIC_RELAXED) == 0)
+    rh_schedWake(&engine->sched); // The feeder may be waiting for more
+  if (isCancelled(engine))
+  {
+    rh_schedSkipSample(&engine->sched, worker);
+    return;
+  }
+  if (worker == engine->feederWorker && engine->feedingEpiphany)
   {
-    unsigned section = __atomic_fetch_add(&nextSieveIdx, SIEVE_BLOCK_SIZE, __ATOMIC_RELAXED);
-    if (section >= SIEVE_SIZE) break;
-    //printf("A: Start %d\n", section);
+    epipFeed(engine, begin, end);
+    return;
+  }
 
-    for (unsigned i = section; i < section + SIEVE_BLOCK_SIZE; ++i)
+  const unsigned int* sieve = engine->sieve;
+  const unsigned int* sieveHighPrime = engine->sieveHighPrime;
+  tuplePipeline_t* pl = &engine->pipelines[worker];
+  unsigned candidates = 0;
+  for (unsigned i = begin; i < end; ++i)
+  {
+    if ((i & 0xff) == 0)
     {
-      if ((i & 0xff) == 0)
-      {
-        if (cancelEverything) return NULL;
-        __builtin_prefetch(&sieve[(i+256)>>5]);
-        __builtin_prefetch(&sieveHighPrime[(i+256)>>5]);
-      }
-      if (((sieve[i>>5] & (1<<(i&0x1f))) == 0) &&
-          ((sieveHighPrime[i>>5] & (1<<(i&0x1f))) == 0))
+      if (isCancelled(engine))
       {
-        singleTest(i, candidate, testpow, testres, two);
+        rh_schedSkipSample(&engine->sched, worker);
+        break;
       }
+      __builtin_prefetch(&sieve[(i+256)>>5]);
+      __builtin_prefetch(&sieveHighPrime[(i+256)>>5]);
+    }
+    if (((sieve[i>>5] & (1<<(i&0x1f))) == 0) &&
+        ((sieveHighPrime[i>>5] & (1<<(i&0x1f))) == 0))
+    {
+      pipelinePush(engine, pl, 0, i, 0);
+      ++candidates;
     }
   }
-  //printf("Test thread complete\n");
-  mpz_clear(candidate);
-  mpz_clear(testpow);
-  mpz_clear(testres);
-  mpz_clear(two);
+
+  // The Epiphany's share isn't counted, this is host throughput
+  rh_statsAdd(RH_STAT_SCANNED, end - begin);
+  rh_statsAdd(RH_STAT_SURVIVORS, candidates);
+}
+
+static int pipelineQueued(const tuplePipeline_t* pl)
+{
+  for (unsigned stage = 0; stage < TUPLE_MEMBERS; ++stage)
+    if (pl->count[stage]) return 1;
+  return 0;
+}
+
+static void* testThread(void* arg)
+{
+  rh_engine_t* engine = ((workerArg_t*)arg)->engine;
+  unsigned worker = ((workerArg_t*)arg)->worker;
+  tuplePipeline_t* pl = &engine->pipelines[worker];
+  rh_numaBindThread(engine->workerNode[worker]);
+  rh_affinityPin(RH_THREAD_TESTER, engine->firstTester + worker);
+  rh_statsSetNode(engine->workerNode[worker]);
+
+  while (1)
+  {
+    unsigned generation = rh_schedGeneration(&engine->sched);
+    if (rh_schedRun(&engine->sched, worker, TASK_SIEVE | TASK_HIGH_PRIMES | TASK_TEST) ||
+        rh_schedRun(&engine->sched, worker, TASK_CLEAR))
+      continue;
+
+    // Out of work, finish off what's queued before parking
+    if (pipelineQueued(pl))
+    {
+      if (!isCancelled(engine))
+        pipelineFlush(engine, pl);
+      pipelineReset(pl);
+      continue;
+    }
+    rh_schedWait(&engine->sched, worker, generation);
+  }
   return NULL;
 }
 
-static unsigned epipReadTestResults(unsigned numCores)
+// Parked workers and a waiting feeder get straight on with stopping
+static void wakeEngine(void* arg)
+{
+  rh_engine_t* engine = arg;
+  rh_schedWake(&engine->sched);
+}
+
+static rh_engine_t* createEngine(unsigned index, unsigned testers, unsigned firstTester)
+{
+  unsigned i;
+  rh_engine_t* engine = calloc(1, sizeof(rh_engine_t));
+  if (!engine)
+  {
+    printf("Out of memory creating engine %u\n", index);
+    exit(-1);
+  }
+  engine->index = index;
+  rh_cancelListen(&searchCancel, wakeEngine, engine);
+  mpz_init2(engine->xPlus16057, RH_MPZ_BITS);
+  mpz_init2(engine->resultCandidate, RH_MPZ_BITS);
+  for (i = 0; i < TUPLE_MEMBERS; ++i)
+    engine->memberOrder[i] = i;
+
+  // With several engines each keeps to one node, taken in turn.  A single
+  // engine spreads its workers over all of them: worker i is on node
+  // i % numNodes, so worker n < numNodes leads node n.
+  unsigned nodes = rh_numaNodes();
+  engine->firstNode = numEngines > 1 ? index % nodes : 0;
+  engine->numNodes = numEngines > 1 ? 1 : (nodes < testers ? nodes : testers);
+
+  for (i = 0; i < 6; ++i)
+    engine->sieveOffsets[i] = rh_numaAlloc(sizeof(unsigned int) * OFFSETS_SIZE, engine->firstNode);
+  for (i = 0; i < 2; ++i)
+  {
+    engine->sieves[i] = rh_numaAlloc(SIEVE_SIZE >> 3, engine->firstNode);
+    engine->sieveHighPrimes[i] = rh_numaAlloc(SIEVE_SIZE >> 3, engine->firstNode);
+  }
+  engine->sieve = engine->sieves[0];
+  engine->sieveHighPrime = engine->sieveHighPrimes[0];
+
+  engine->numTesters = testers;
+  engine->feederWorker = testers;
+  engine->firstTester = firstTester;
+  rh_schedInit(&engine->sched, testers + 1);
+
+  engine->workerNode = calloc(testers + 1, sizeof(unsigned));
+  for (i = 0; i < testers; ++i)
+  {
+    engine->workerNode[i] = engine->firstNode + i % engine->numNodes;
+    rh_schedSetGroup(&engine->sched, i, engine->workerNode[i]);
+    nodeWorkers[engine->workerNode[i]]++;
+  }
+  engine->workerNode[engine->feederWorker] = engine->firstNode;
+
+  // Contiguous runs of sieve segments go to each node
+  unsigned numNodes = engine->numNodes;
+  for (unsigned n = 0; n < numNodes; ++n)
+  {
+    unsigned begin = ((SIEVE_SEGMENTS * n + numNodes - 1) / numNodes) * SIEVE_SEGMENT_SIZE;
+    unsigned end = ((SIEVE_SEGMENTS * (n + 1) + numNodes - 1) / numNodes) * SIEVE_SEGMENT_SIZE;
+    for (i = 0; i < 2; ++i)
+    {
+      rh_numaPlace(&engine->sieves[i][begin>>5], (end - begin) >> 3, engine->firstNode + n);
+      rh_numaPlace(&engine->sieveHighPrimes[i][begin>>5], (end - begin) >> 3, engine->firstNode + n);
+    }
+    engine->nodeSieveBegin[n] = begin < START_BLOCK*SIEVE_BLOCK_SIZE ? START_BLOCK*SIEVE_BLOCK_SIZE : begin;
+    engine->nodeSieveEnd[n] = end;
+  }
+  for (i = 0; i < SIEVE_SEGMENTS; ++i)
+    pthread_mutex_init(&engine->segmentLock[i], NULL);
+  for (i = 0; i < HIGH_PRIME_PAGES; ++i)
+  {
+    engine->highPrimePages[i].engine = engine;
+    engine->freeHighPrimePages[i] = &engine->highPrimePages[i];
+  }
+  engine->numFreeHighPrimePages = HIGH_PRIME_PAGES;
+  pthread_mutex_init(&engine->highPrimePageLock, NULL);
+
+  // The feeder has a pipeline too, for when it can't have the Epiphany
+  engine->pipelines = malloc(sizeof(tuplePipeline_t) * (testers + 1));
+  engine->workerArgs = malloc(sizeof(workerArg_t) * testers);
+  for (i = 0; i <= testers; ++i)
+    pipelineInit(&engine->pipelines[i]);
+  return engine;
+}
+
+static void startWorkers(rh_engine_t* engine)
+{
+  if (numEngines > 1)
+    printf("Engine %u: starting %u tester threads\n", engine->index, engine->numTesters);
+  else
+    printf("Starting %u tester threads\n", engine->numTesters);
+  for (unsigned i = 0; i < engine->numTesters; ++i)
+  {
+    engine->workerArgs[i].engine = engine;
+    engine->workerArgs[i].worker = i;
+    pthread_t tid;
+    pthread_create(&tid, NULL, testThread, &engine->workerArgs[i]);
+    pthread_detach(tid);
+  }
+}
+
+// Waits for a started core to finish and reports what it found
+static unsigned epipReadCoreResults(rh_engine_t* engine, unsigned core)
 {
-  mpz_t candidate;
-  mpz_init(candidate);
+  mpz_ptr candidate = engine->resultCandidate;
   ptest_outdata_t ptest_outbuf;
-  unsigned totalSleeps = 0;
   int sleeps;
 
-  //printf("Reading results\n");
-  for (unsigned core = 0; core < numCores; ++core)
+  engine->epipBusy &= ~(1u << core);
+  if ((sleeps = epip_waitfor(core>>2, core&3)) < 0) 
   {
-    //fprintf(stderr, ".");
-    if ((sleeps = epip_waitfor(core>>2, core&3)) < 0) 
+    printf("Ignoring stuck core %d\n", core);
+    exit(-1);
+    return 0;
+  }
+  if (e_read(&epip_mem, 0, 0, EPIP_PTEST_OUT_OFFSET(core), &ptest_outbuf, sizeof(ptest_outdata_t)) != sizeof(ptest_outdata_t)) printf("Read error on core %d\n", core);
+
+  for (unsigned i = 0; i < ptest_outbuf.num_results; ++i)
+  {
+    if (ptest_outbuf.result[i].primes < 2 ||
+        ptest_outbuf.result[i].primes > 6)
     {
-      printf("Ignoring stuck core %d\n", core);
+      printf("Error - %d prime report from core %d\n", ptest_outbuf.result[i].primes, core);
       exit(-1);
-      continue;
+      break;
     }
-    totalSleeps += sleeps;
-    if (e_read(&epip_mem, 0, 0, EPIP_PTEST_OUT_OFFSET(core), &ptest_outbuf, sizeof(ptest_outdata_t)) != sizeof(ptest_outdata_t)) printf("Read error on core %d\n", core);
+    mpz_mul_ui(candidate, primorial, ptest_outbuf.result[i].k);
+    mpz_add(candidate, candidate, engine->xPlus16057);
+    reportSuccess(engine->context, candidate, ptest_outbuf.result[i].primes|0x10);
+  }
+  return sleeps;
+}
+
+// Reads a core's last results before giving it its next candidates, so
+// the other cores keep running while the host refills this one
+static void epipStartCore(rh_engine_t* engine, unsigned core)
+{
+  if (engine->epipBusy & (1u << core))
+    epipReadCoreResults(engine, core);
+  e_write(&epip_mem, 0, 0, EPIP_PTEST_IN_OFFSET(core), &engine->epipInbuf[core], sizeof(ptest_indata_t));
+  e_start(&epip_dev, core>>2, core&3);
+  engine->epipBusy |= 1u << core;
+}
 
-    for (unsigned i = 0; i < ptest_outbuf.num_results; ++i)
+static void epipFeed(rh_engine_t* engine, unsigned begin, unsigned end)
+{
+  const unsigned int* sieve = engine->sieve;
+  const unsigned int* sieveHighPrime = engine->sieveHighPrime;
+  for (unsigned i = begin; i < end; ++i)
+  {
+    if (((sieve[i>>5] & (1<<(i&0x1f))) == 0) &&
+        ((sieveHighPrime[i>>5] & (1<<(i&0x1f))) == 0))
     {
-      if (ptest_outbuf.result[i].primes < 2 ||
-          ptest_outbuf.result[i].primes > 6)
+      unsigned epipCore = engine->epipCore;
+      ptest_indata_t* inbuf = &engine->epipInbuf[epipCore];
+      inbuf->k[inbuf->num_candidates++] = i;
+      if (inbuf->num_candidates == PTEST_NUM_CANDIDATES)
       {
-        printf("Error - %d prime report from core %d\n", ptest_outbuf.result[i].primes, core);
-        exit(-1);
-        break;
-      }
-      {
-        mpz_mul_ui(candidate, primorial, ptest_outbuf.result[i].k);
-        mpz_add(candidate, candidate, xPlus16057);
-        reportSuccess(candidate, ptest_outbuf.result[i].primes|0x10);
+        //printf("Start core %d\n", epipCore);
+        epipStartCore(engine, epipCore);
+        inbuf->num_candidates = 0;
+        if (isCancelled(engine))
+        {
+          rh_schedSkipSample(&engine->sched, engine->feederWorker);
+          return;
+        }
       }
-    } 
-  }  
-  mpz_clear(candidate);
-  return totalSleeps;
+      engine->epipCore = (epipCore + 1) & 0xf;
+    }
+  }
 }
 
-static void epipTester()
+static void epipTester(rh_engine_t* engine)
 {
-  //printf("Load epiphany with primetest program\n");
-  e_load_group(EPIP_SREC_DIR "e_primetest.srec", &epip_dev, 0, 0, epip_platform.rows, epip_platform.cols, E_FALSE);
+  // If another engine is testing on the Epiphany the feeder tests on the
+  // host, like the testers
+  engine->feedingEpiphany = pthread_mutex_trylock(&epipLock) == 0;
+  if (engine->feedingEpiphany)
+  {
+    //printf("Load epiphany with primetest program\n");
+    e_load_group(EPIP_SREC_DIR "e_primetest.srec", &epip_dev, 0, 0, epip_platform.rows, epip_platform.cols, E_FALSE);
 
-  ptest_indata_t inbuf[16];
+    for (unsigned i = 0; i < 16; ++i)
+    {
+      engine->epipInbuf[i].nn = mpz_size(engine->xPlus16057);
+      memcpy(engine->epipInbuf[i].n, engine->xPlus16057->_mp_d, sizeof(mp_limb_t)*engine->epipInbuf[i].nn);
+      engine->epipInbuf[i].num_candidates = 0;
+    }
+    engine->epipCore = 0;
+    engine->epipBusy = 0;
+  }
+  rh_schedSetClass(&engine->sched, engine->feederWorker, engine->feedingEpiphany ? WORKER_EPIPHANY : WORKER_HOST);
 
-  for (unsigned i = 0; i < 16; ++i)
+  // Take test ranges until there are none left, waiting for the testers
+  // to split theirs when none are queued.
+  while (engine->testsLeft && !isCancelled(engine))
   {
-    inbuf[i].nn = mpz_size(xPlus16057);
-    memcpy(inbuf[i].n, xPlus16057->_mp_d, sizeof(mp_limb_t)*inbuf[i].nn);
-    inbuf[i].num_candidates = 0;
+    unsigned generation = rh_schedGeneration(&engine->sched);
+    if (!rh_schedRun(&engine->sched, engine->feederWorker, TASK_TEST) && engine->testsLeft && !isCancelled(engine))
+      rh_schedWait(&engine->sched, engine->feederWorker, generation);
   }
 
-  unsigned core = 0;
-
-  while (1)
+  if (engine->feedingEpiphany)
   {
-    unsigned section = __atomic_fetch_add(&nextSieveIdx, SIEVE_BLOCK_SIZE, __ATOMIC_RELAXED);
-    if (section >= SIEVE_SIZE) break;
-    //printf("E: Start %d\n", section);
-
-    for (unsigned i = section; i < section + SIEVE_BLOCK_SIZE; ++i)
+    if (!isCancelled(engine))
     {
-      if (((sieve[i>>5] & (1<<(i&0x1f))) == 0) &&
-          ((sieveHighPrime[i>>5] & (1<<(i&0x1f))) == 0))
+      for (unsigned core = 0; core < 16; core++)
       {
-        inbuf[core].k[inbuf[core].num_candidates++] = i;
-        if (inbuf[core].num_candidates == PTEST_NUM_CANDIDATES)
-        {
-          //printf("Start core %d\n", core);
-          e_write(&epip_mem, 0, 0, EPIP_PTEST_IN_OFFSET(core), &inbuf[core], sizeof(ptest_indata_t));
-          e_start(&epip_dev, core>>2, core&3);
-          if (core == 15)
-          {
-            epipReadTestResults(16);
-            if (checkRestart())
-            {
-              cancelEverything = 1;
-              goto CANCEL;
-            }
-          }
-          inbuf[core].num_candidates = 0;
-        }
-        core = (core + 1) & 0xf;
+        //printf("Send %d candidates to core %d\n", engine->epipInbuf[core].num_candidates, core);
+        if (engine->epipInbuf[core].num_candidates)
+          epipStartCore(engine, core);
       }
+      for (unsigned core = 0; core < 16; core++)
+        if (engine->epipBusy & (1u << core))
+          epipReadCoreResults(engine, core);
     }
+    pthread_mutex_unlock(&epipLock);
   }
-
-  for (core = 0; core < 16; core++)
+  else
   {
-    //printf("Send %d candidates to core %d\n", inbuf[core].num_candidates, core);
-    e_write(&epip_mem, 0, 0, EPIP_PTEST_IN_OFFSET(core), &inbuf[core], sizeof(ptest_indata_t));
-    e_start(&epip_dev, core>>2, core&3);
+    tuplePipeline_t* pl = &engine->pipelines[engine->feederWorker];
+    if (!isCancelled(engine))
+      pipelineFlush(engine, pl);
+    pipelineReset(pl);
   }
-  epipReadTestResults(16);
 
-CANCEL:
-  pthread_join(test_tid[0], NULL);
-  pthread_join(test_tid[1], NULL);
+  rh_schedWaitIdle(&engine->sched, engine->feederWorker);
 }
 
-void rh_search(mpz_t target)
+void rh_searchWorkUnit(rh_engine_t* engine, rh_workUnit_t* unit, void* context)
 {
   struct timespec tv;
   double start, end;
   clock_gettime(CLOCK_MONOTONIC, &tv);
   start = tv.tv_sec + (tv.tv_nsec / 1000000000.0);
 
-  cancelEverything = 0;
+  // An engine's units are always searched by the same thread
+  if (!engine->searchPinned)
+  {
+    rh_numaBindThread(engine->firstNode);
+    rh_affinityPin(RH_THREAD_SEARCH, engine->index);
+    rh_statsSetNode(engine->firstNode);
+    engine->searchPinned = 1;
+  }
 
-  mpz_set(base, target);
- 
-  initSieve();
-  if (cancelEverything || checkRestart())
+  // The epoch is read before the unit's block is checked, so a block
+  // change is either seen by checkRestart or moves the epoch later
+  engine->context = context;
+  engine->cancelEverything = 0;
+  engine->epoch = rh_cancelEpoch(&searchCancel);
+  if (checkRestart(context)) return;
+
+  engine->fermatLimbs = mpz_size(unit->xPlus16057);
+  engine->fermatTest = rh_selectFermatTest(engine->fermatLimbs);
+  engine->fermatBatch = rh_selectFermatBatch(engine->fermatLimbs, &engine->fermatLanes);
+  chooseMemberOrder(engine);
+
+  for (unsigned i = 0; i <= engine->numTesters; ++i)
+    pipelineStart(engine, &engine->pipelines[i]);
+
+  engine->firstSieveAt = 0;
+  initSieve(engine, unit);
+  if (isCancelled(engine))
   {
-    cancelEverything = 1;
-    pthread_join(test_tid[0], NULL);
+    rh_schedWake(&engine->sched);
+    rh_schedWaitIdle(&engine->sched, engine->feederWorker);
+  }
+  else
+    epipTester(engine);
+  recycleSieve(engine);
+  if (isCancelled(engine))
+  {
+    rh_cancelStopped(&searchCancel, engine->epoch);
+    engine->lastTestsDone = 0;
     return;
   }
-
-  // First thread was kicked off already.
-  pthread_create(&test_tid[1], NULL, testThread, NULL);
-  epipTester(test_tid);
+  engine->lastTestsDone = rh_cancelNow();
 
   clock_gettime(CLOCK_MONOTONIC, &tv);
   end = tv.tv_sec + (tv.tv_nsec / 1000000000.0);
-  printf("Tested in %.3f\n", end - start);
+  if (engine->feedingEpiphany)
+    printf("Tested in %.3f (sieve indexes/s: %.0fk per tester, %.0fk on the Epiphany)\n", end - start,
+           rh_schedClassRate(&engine->sched, WORKER_HOST, TASK_TEST) / 1000.0,
+           rh_schedClassRate(&engine->sched, WORKER_EPIPHANY, TASK_TEST) / 1000.0);
+  else
+    printf("Tested in %.3f\n", end - start);
 }
@@ -1,14 +1,64 @@
 #pragma once
 
+#include <stdint.h>
+#include "rh_numa.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-typedef unsigned (*checkRestart_t)();
-typedef void (*reportSuccess_t)(mpz_t, unsigned);
+// The callbacks are passed the context given to rh_searchWorkUnit
+typedef unsigned (*checkRestart_t)(void* context);
+typedef void (*reportSuccess_t)(void* context, mpz_t, unsigned);
+typedef struct rh_workUnit_s rh_workUnit_t;
+typedef struct rh_engine_s rh_engine_t;
+
+// Starts testers host Fermat test threads, or one per online core if 0,
+// shared out between engines that each run their own search.  The prime
+// tables are built once for all of them.
+void rh_oneTimeInit(reportSuccess_t, checkRestart_t, unsigned testers, unsigned engines);
+unsigned rh_numEngines();
+rh_engine_t* rh_getEngine(unsigned index);
+
+// Work units let the target dependent setup of a search be done in advance.
+// Each engine searches one unit at a time, always from the same thread.
+rh_workUnit_t* rh_createWorkUnit();
+void rh_prepareWorkUnit(rh_workUnit_t*, mpz_t);
+void rh_searchWorkUnit(rh_engine_t*, rh_workUnit_t*, void* context);
+
+// Stops every search started before the call, e.g. on a new block, waking
+// any of its threads that are asleep.  Safe to call from any thread.
+void rh_cancelSearches();
+
+// Time from rh_cancelSearches to the searches it cancelled stopping, as
+// counts in RH_ABORT_BUCKETS buckets where bucket i is under 2^i us
+#define RH_ABORT_BUCKETS 24
+void rh_getAbortLatency(uint64_t* buckets);
+
+// Tuple testing funnel for each stage: the offset of the member it tests,
+// candidates waiting for the test, and the number tested and passed so far
+#define TUPLE_MEMBERS 6
+typedef struct
+{
+  unsigned offset;
+  unsigned queued;
+  uint64_t tested;
+  uint64_t passed;
+} rh_stageStats_t;
+
+void rh_getStageStats(rh_stageStats_t* stats);
+
+// Host testing done on each NUMA node: sieve indexes scanned and the
+// survivors queued for Fermat tests.  Fills up to RH_NUMA_MAX_NODES
+// entries and returns the number of nodes with workers.
+typedef struct
+{
+  unsigned workers;
+  uint64_t scanned;
+  uint64_t candidates;
+} rh_nodeStats_t;
 
-void rh_oneTimeInit(reportSuccess_t, checkRestart_t);
-void rh_search(mpz_t);
+unsigned rh_getNodeStats(rh_nodeStats_t* stats);
 
 #ifdef __cplusplus
 }
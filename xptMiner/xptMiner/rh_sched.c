@@ -0,0 +1,306 @@
+#include "rh_sched.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Weight of each new timing in a worker's throughput
+#define RATE_WEIGHT 0.125
+
+void rh_schedInit(rh_sched_t* sched, unsigned workers)
+{
+  memset(sched, 0, sizeof(rh_sched_t));
+  sched->numWorkers = workers;
+  sched->busy = calloc(workers, 1);
+  sched->group = calloc(workers, sizeof(unsigned));
+  sched->cls = calloc(workers, sizeof(unsigned));
+  sched->rate = calloc(workers * RH_SCHED_MAX_CLASSES * RH_SCHED_KINDS, sizeof(double));
+  sched->noSample = calloc(workers, 1);
+  if (!sched->busy || !sched->group || !sched->cls || !sched->rate || !sched->noSample || posix_memalign((void**)&sched->deques, 64, sizeof(rh_deque_t) * workers))
+  {
+    printf("Out of memory creating scheduler\n");
+    exit(-1);
+  }
+  for (unsigned w = 0; w < workers; ++w)
+  {
+    pthread_mutex_init(&sched->deques[w].lock, NULL);
+    sched->deques[w].head = sched->deques[w].tail = 0;
+  }
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->wake, NULL);
+  pthread_cond_init(&sched->idle, NULL);
+}
+
+void rh_schedSetGroup(rh_sched_t* sched, unsigned worker, unsigned group)
+{
+  sched->group[worker] = group;
+}
+
+void rh_schedSetClass(rh_sched_t* sched, unsigned worker, unsigned cls)
+{
+  if (cls >= RH_SCHED_MAX_CLASSES)
+  {
+    printf("Scheduler class %u out of range\n", cls);
+    exit(-1);
+  }
+  __atomic_store_n(&sched->cls[worker], cls, __ATOMIC_RELAXED);
+}
+
+void rh_schedSkipSample(rh_sched_t* sched, unsigned worker)
+{
+  sched->noSample[worker] = 1;
+}
+
+static inline unsigned kindIndex(unsigned kind)
+{
+  return __builtin_ctz(kind) % RH_SCHED_KINDS;
+}
+
+static inline double* workerRate(rh_sched_t* sched, unsigned worker, unsigned cls, unsigned kindIdx)
+{
+  return &sched->rate[(worker * RH_SCHED_MAX_CLASSES + cls) * RH_SCHED_KINDS + kindIdx];
+}
+
+// Units per us, averaged over the class's timed workers
+static double classRate(rh_sched_t* sched, unsigned cls, unsigned kindIdx)
+{
+  double sum = 0;
+  unsigned timed = 0;
+  for (unsigned w = 0; w < sched->numWorkers; ++w)
+  {
+    double rate;
+    __atomic_load(workerRate(sched, w, cls, kindIdx), &rate, __ATOMIC_RELAXED);
+    if (rate > 0)
+    {
+      sum += rate;
+      ++timed;
+    }
+  }
+  return timed ? sum / timed : 0;
+}
+
+double rh_schedClassRate(rh_sched_t* sched, unsigned cls, unsigned kind)
+{
+  return classRate(sched, cls, kindIndex(kind)) * 1000000.0;
+}
+
+static double nowUs()
+{
+  struct timespec tv;
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return tv.tv_sec * 1000000.0 + tv.tv_nsec / 1000.0;
+}
+
+// Only the worker writes its own rates
+static void timePiece(rh_sched_t* sched, unsigned worker, unsigned kind, unsigned units, double us)
+{
+  if (sched->noSample[worker])
+  {
+    sched->noSample[worker] = 0;
+    return;
+  }
+  if (us <= 0) return;
+  double* rate = workerRate(sched, worker, sched->cls[worker], kindIndex(kind));
+  double sample = units / us;
+  sample = *rate > 0 ? *rate + (sample - *rate) * RATE_WEIGHT : sample;
+  __atomic_store(rate, &sample, __ATOMIC_RELAXED);
+}
+
+// How much of the left units of task the runner keeps when splitting it
+// for a hungry worker, in whole grains, or 0 not to split.  The fastest
+// hungry class is the one expected to steal; classes not yet timed count
+// as fast as the runner's.
+static unsigned splitKeep(rh_sched_t* sched, unsigned worker, const rh_task_t* task, unsigned left)
+{
+  unsigned kindIdx = kindIndex(task->kind);
+  double mine = classRate(sched, sched->cls[worker], kindIdx);
+  double theirs = 0;
+  for (unsigned c = 0; c < RH_SCHED_MAX_CLASSES; ++c)
+  {
+    if (__atomic_load_n(&sched->hungryClass[c], __ATOMIC_RELAXED))
+    {
+      double rate = classRate(sched, c, kindIdx);
+      if (rate == 0) rate = mine;
+      if (rate > theirs) theirs = rate;
+    }
+  }
+
+  double share = 0.5;
+  if (mine > 0 && theirs > 0)
+  {
+    if (task->grain / theirs > left / mine) return 0;
+    share = mine / (mine + theirs);
+  }
+  unsigned grains = left / task->grain;
+  unsigned keep = (unsigned)(grains * share + 0.5);
+  if (keep < 1) keep = 1;
+  if (keep > grains - 1) keep = grains - 1;
+  return keep * task->grain;
+}
+
+static void setHungry(rh_sched_t* sched, unsigned worker, int hungry)
+{
+  unsigned cls = sched->cls[worker];
+  if (hungry)
+  {
+    __atomic_add_fetch(&sched->hungryClass[cls], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sched->hungry, 1, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_sub_fetch(&sched->hungry, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&sched->hungryClass[cls], 1, __ATOMIC_RELAXED);
+  }
+}
+
+// The generation is bumped before sleepers is read, and a sleeper counts
+// itself before reading the generation, so either the pusher sees the
+// sleeper or the sleeper sees the push.
+void rh_schedWake(rh_sched_t* sched)
+{
+  __atomic_add_fetch(&sched->generation, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sched->sleepers, __ATOMIC_SEQ_CST))
+  {
+    pthread_mutex_lock(&sched->lock);
+    pthread_cond_broadcast(&sched->wake);
+    pthread_mutex_unlock(&sched->lock);
+  }
+}
+
+static void markBusy(rh_sched_t* sched, unsigned worker)
+{
+  if (!sched->busy[worker])
+  {
+    sched->busy[worker] = 1;
+    __atomic_add_fetch(&sched->busyWorkers, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Called with sched->lock held
+static void markIdle(rh_sched_t* sched, unsigned worker)
+{
+  if (sched->busy[worker])
+  {
+    sched->busy[worker] = 0;
+    if (__atomic_sub_fetch(&sched->busyWorkers, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&sched->pending, __ATOMIC_SEQ_CST) == 0)
+      pthread_cond_broadcast(&sched->idle);
+  }
+}
+
+static void runTask(rh_sched_t* sched, unsigned worker, rh_task_t task);
+
+void rh_schedPush(rh_sched_t* sched, unsigned worker, const rh_task_t* task)
+{
+  rh_deque_t* d = &sched->deques[worker];
+  __atomic_add_fetch(&sched->pending, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&d->lock);
+  if (d->tail - d->head < RH_SCHED_DEQUE_SIZE)
+  {
+    d->tasks[d->tail++ % RH_SCHED_DEQUE_SIZE] = *task;
+    pthread_mutex_unlock(&d->lock);
+    rh_schedWake(sched);
+    return;
+  }
+  pthread_mutex_unlock(&d->lock);
+  runTask(sched, worker, *task);
+}
+
+static void runTask(rh_sched_t* sched, unsigned worker, rh_task_t task)
+{
+  markBusy(sched, worker);
+  while (task.begin < task.end)
+  {
+    unsigned left = task.end - task.begin;
+    unsigned keep;
+    if (left >= 2 * task.grain && __atomic_load_n(&sched->hungry, __ATOMIC_RELAXED) &&
+        (keep = splitKeep(sched, worker, &task, left)) != 0)
+    {
+      rh_task_t top = task;
+      top.begin = task.begin + keep;
+      task.end = top.begin;
+      rh_schedPush(sched, worker, &top);
+      continue;
+    }
+    unsigned end = left > task.grain ? task.begin + task.grain : task.end;
+    double start = nowUs();
+    task.fn(&task, task.begin, end, worker);
+    timePiece(sched, worker, task.kind, end - task.begin, nowUs() - start);
+    task.begin = end;
+  }
+  __atomic_sub_fetch(&sched->pending, 1, __ATOMIC_SEQ_CST);
+}
+
+// Takes the first task of the given kinds, from the oldest end for a thief
+static int takeTask(rh_deque_t* d, unsigned kinds, int steal, rh_task_t* task)
+{
+  if (__atomic_load_n(&d->head, __ATOMIC_RELAXED) == __atomic_load_n(&d->tail, __ATOMIC_RELAXED))
+    return 0;
+
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  for (unsigned n = 0; n < d->tail - d->head; ++n)
+  {
+    unsigned i = steal ? d->head + n : d->tail - 1 - n;
+    if (d->tasks[i % RH_SCHED_DEQUE_SIZE].kind & kinds)
+    {
+      *task = d->tasks[i % RH_SCHED_DEQUE_SIZE];
+      for (; i + 1 < d->tail; ++i)
+        d->tasks[i % RH_SCHED_DEQUE_SIZE] = d->tasks[(i + 1) % RH_SCHED_DEQUE_SIZE];
+      d->tail--;
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+int rh_schedRun(rh_sched_t* sched, unsigned worker, unsigned kinds)
+{
+  rh_task_t task;
+  if (!takeTask(&sched->deques[worker], kinds, 0, &task))
+  {
+    setHungry(sched, worker, 1);
+    // Steal from the same group first, so work stays on its node
+    int found = 0;
+    for (int local = 1; local >= 0 && !found; --local)
+    {
+      for (unsigned k = 1; k < sched->numWorkers && !found; ++k)
+      {
+        unsigned victim = (worker + k) % sched->numWorkers;
+        if ((sched->group[victim] == sched->group[worker]) == local)
+          found = takeTask(&sched->deques[victim], kinds, 1, &task);
+      }
+    }
+    setHungry(sched, worker, 0);
+    if (!found) return 0;
+  }
+  runTask(sched, worker, task);
+  return 1;
+}
+
+void rh_schedWait(rh_sched_t* sched, unsigned worker, unsigned generation)
+{
+  pthread_mutex_lock(&sched->lock);
+  markIdle(sched, worker);
+  setHungry(sched, worker, 1);
+  __atomic_add_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&sched->generation, __ATOMIC_SEQ_CST) == generation)
+    pthread_cond_wait(&sched->wake, &sched->lock);
+  __atomic_sub_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+  setHungry(sched, worker, 0);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void rh_schedWaitIdle(rh_sched_t* sched, unsigned worker)
+{
+  pthread_mutex_lock(&sched->lock);
+  markIdle(sched, worker);
+  while (__atomic_load_n(&sched->pending, __ATOMIC_SEQ_CST) ||
+         __atomic_load_n(&sched->busyWorkers, __ATOMIC_SEQ_CST))
+    pthread_cond_wait(&sched->idle, &sched->lock);
+  pthread_mutex_unlock(&sched->lock);
+}
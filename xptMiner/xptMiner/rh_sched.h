@@ -0,0 +1,107 @@
+#pragma once
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Work stealing scheduler.  Each worker has a deque of range tasks: it
+// runs its own newest task first, and when it has none takes the oldest
+// task of another worker.  A task runs its range grain at a time, and
+// while any worker is looking for work the runner splits off the top half
+// of what is left for it to steal.  So ranges stay whole when everyone is
+// busy and are cut finer only as far as needed to keep workers balanced.
+// Workers are in groups, one per NUMA node, and steal within their own
+// group before going to another.
+//
+// Workers are also in classes, one for each kind of backend they drive.
+// The scheduler times every piece of a range each worker runs, and when
+// it splits a range for a hungry worker the runner keeps a share in
+// proportion to its class's throughput against the hungry class's, so
+// that both should finish at the same time.  A worker too slow to finish
+// even a grain before the runner would finish the lot is left hungry.
+
+typedef struct rh_task_s rh_task_t;
+
+// Runs [begin, end) of task's range on the given worker
+typedef void (*rh_taskFn_t)(const rh_task_t* task, unsigned begin, unsigned end, unsigned worker);
+
+struct rh_task_s
+{
+  rh_taskFn_t fn;
+  void* arg;
+  unsigned param[2]; // Passed through to fn
+  unsigned kind;     // Single bit, so workers can choose what they take
+  unsigned begin, end;
+  unsigned grain;    // Never split smaller than this
+};
+
+#define RH_SCHED_DEQUE_SIZE 64
+#define RH_SCHED_MAX_CLASSES 4
+#define RH_SCHED_KINDS 8 // Task kinds are bits below this
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  unsigned head, tail; // tasks[head..tail), thieves take from head
+  rh_task_t tasks[RH_SCHED_DEQUE_SIZE];
+} __attribute__ ((aligned (64))) rh_deque_t;
+
+typedef struct
+{
+  unsigned numWorkers;
+  rh_deque_t* deques;
+  unsigned char* busy;       // Worker has run a task since it last waited
+  unsigned* group;
+  unsigned* cls;
+  double* rate;              // Units per us by worker, class and kind, 0 until timed
+  unsigned char* noSample;   // Don't time the piece the worker is running
+  volatile unsigned pending; // Tasks pushed and not yet finished
+  volatile unsigned hungry;  // Workers looking for a task
+  volatile unsigned hungryClass[RH_SCHED_MAX_CLASSES];
+  volatile unsigned busyWorkers;
+  volatile unsigned generation; // Bumped by every push
+  volatile unsigned sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t wake, idle;
+} rh_sched_t;
+
+// All workers start in group 0 and class 0
+void rh_schedInit(rh_sched_t* sched, unsigned workers);
+void rh_schedSetGroup(rh_sched_t* sched, unsigned worker, unsigned group);
+
+// Only the worker itself may change its class, between tasks
+void rh_schedSetClass(rh_sched_t* sched, unsigned worker, unsigned cls);
+
+// Called from a task function that stopped early, e.g. on cancellation,
+// so the piece doesn't count towards the worker's throughput
+void rh_schedSkipSample(rh_sched_t* sched, unsigned worker);
+
+// Average throughput of the class's workers on tasks of kind, in units
+// per second, or 0 if none has been timed yet
+double rh_schedClassRate(rh_sched_t* sched, unsigned cls, unsigned kind);
+
+// Queues a task on worker's deque, or runs it there and then if it is full
+void rh_schedPush(rh_sched_t* sched, unsigned worker, const rh_task_t* task);
+
+// Runs one task of the given kinds, returning 0 if there wasn't one
+int rh_schedRun(rh_sched_t* sched, unsigned worker, unsigned kinds);
+
+// Parks worker until something is pushed after generation was read.
+// Read the generation before looking for work, so a push can't be missed.
+static inline unsigned rh_schedGeneration(rh_sched_t* sched)
+{
+  return __atomic_load_n(&sched->generation, __ATOMIC_SEQ_CST);
+}
+void rh_schedWait(rh_sched_t* sched, unsigned worker, unsigned generation);
+
+// Wakes parked workers to recheck whatever else they are waiting for
+void rh_schedWake(rh_sched_t* sched);
+
+// Waits until every task has finished and every other worker has parked
+void rh_schedWaitIdle(rh_sched_t* sched, unsigned worker);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,54 @@
+#include "rh_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static rh_statsSlot_t slots[RH_STATS_MAX_THREADS];
+static volatile unsigned numSlots;
+static uint64_t baseline[RH_STATS];
+
+__thread rh_statsSlot_t* rh_statsMine;
+
+rh_statsSlot_t* rh_statsClaim()
+{
+  unsigned n = __atomic_fetch_add(&numSlots, 1, __ATOMIC_RELAXED);
+  if (n >= RH_STATS_MAX_THREADS)
+  {
+    printf("Too many threads for stats counters\n");
+    exit(-1);
+  }
+  rh_statsMine = &slots[n];
+  return rh_statsMine;
+}
+
+void rh_statsSetNode(unsigned node)
+{
+  rh_statsSlot_t* slot = rh_statsMine ? rh_statsMine : rh_statsClaim();
+  __atomic_store_n(&slot->node, node, __ATOMIC_RELAXED);
+}
+
+static uint64_t total(unsigned stat, int node)
+{
+  unsigned n = __atomic_load_n(&numSlots, __ATOMIC_RELAXED);
+  if (n > RH_STATS_MAX_THREADS) n = RH_STATS_MAX_THREADS;
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < n; ++i)
+    if (node < 0 || __atomic_load_n(&slots[i].node, __ATOMIC_RELAXED) == (unsigned)node)
+      sum += __atomic_load_n(&slots[i].count[stat], __ATOMIC_RELAXED);
+  return sum;
+}
+
+uint64_t rh_statsGet(unsigned stat)
+{
+  return total(stat, -1) - __atomic_load_n(&baseline[stat], __ATOMIC_RELAXED);
+}
+
+uint64_t rh_statsGetNode(unsigned stat, unsigned node)
+{
+  return total(stat, node);
+}
+
+void rh_statsReset(unsigned stat)
+{
+  __atomic_store_n(&baseline[stat], total(stat, -1), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Statistics counters.  Every thread counts into its own cache line, with
+// a plain load and store as nothing else writes it, so counting costs no
+// more than a local variable would.  Reads add the slots up; they are
+// only a snapshot while threads are counting.  Resetting a counter keeps
+// the current total as a baseline to subtract rather than touching the
+// slots.
+
+#define RH_STATS_MAX_THREADS 256
+
+enum
+{
+  RH_STAT_2CH,              // Tuples of at least 2, 3 and 4 primes found
+  RH_STAT_3CH,
+  RH_STAT_4CH,
+  RH_STAT_SHARES,           // Shares submitted
+  RH_STAT_REJECTED,         // Shares the pool rejected
+  RH_STAT_VERIFIED,         // Tuples checked again by the verify threads
+  RH_STAT_VERIFY_REJECTED,  // and failed
+  RH_STAT_SCANNED,          // Sieve indexes scanned by host testers
+  RH_STAT_SURVIVORS,        // Sieve survivors queued for Fermat tests by them
+  RH_STAT_DUPLICATE_TARGETS, // Work units skipped as their target was searched recently
+  RH_STAT_STAGE_QUEUED,     // Candidates waiting, by stage, 6 counters
+  RH_STAT_STAGE_TESTED = RH_STAT_STAGE_QUEUED + 6,  // Fermat tests by stage
+  RH_STAT_STAGE_PASSED = RH_STAT_STAGE_TESTED + 6,
+  RH_STAT_MEMBER_TESTED = RH_STAT_STAGE_PASSED + 6, // Fermat tests by tuple member
+  RH_STAT_MEMBER_PASSED = RH_STAT_MEMBER_TESTED + 6,
+  RH_STATS = RH_STAT_MEMBER_PASSED + 6
+};
+
+typedef struct
+{
+  uint64_t count[RH_STATS];
+  unsigned node; // NUMA node of the thread, for per node totals
+} __attribute__ ((aligned (64))) rh_statsSlot_t;
+
+extern __thread rh_statsSlot_t* rh_statsMine;
+
+// Gives the calling thread its slot, on its first count
+rh_statsSlot_t* rh_statsClaim();
+
+// n may be negative, cast, for counters that go down as well as up
+static inline void rh_statsAdd(unsigned stat, uint64_t n)
+{
+  rh_statsSlot_t* slot = rh_statsMine;
+  if (__builtin_expect(slot == 0, 0)) slot = rh_statsClaim();
+  __atomic_store_n(&slot->count[stat], slot->count[stat] + n, __ATOMIC_RELAXED);
+}
+
+static inline void rh_statsInc(unsigned stat)
+{
+  rh_statsAdd(stat, 1);
+}
+
+// Counts from the calling thread go towards node's totals
+void rh_statsSetNode(unsigned node);
+
+// Total since the counter was last reset
+uint64_t rh_statsGet(unsigned stat);
+
+// Total counted by threads on node, ignoring resets
+uint64_t rh_statsGetNode(unsigned stat, unsigned node);
+
+// Starts the counter again from 0.  Only one thread may reset a counter.
+void rh_statsReset(unsigned stat);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,8 +4,16 @@
 // Modifications copyright Mike Bell 2015.
 
 #include "global.h"
+#include "ticker.h"
 #include <assert.h>
 #include "rh_riecoin.h"
+#include "rh_alloc.h"
+#include "rh_stats.h"
+#include "tsqueue.hpp"
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 
 #define zeroesBeforeHashInPrime	8
 
@@ -17,88 +25,141 @@
 #define DPRINTF(fmt, ...) do { } while(0)
 #endif
 
-minerRiecoinBlock_t* verify_block;
-mpz_t z_target;
-
-CRITICAL_SECTION success_lock;
+// Sized on each thread's first report so reports never allocate
+__thread mpz_t reportValue;
 
-unsigned checkRestart()
+// The callback context is the riecoinWorkUnit_t being searched
+unsigned checkRestart(void* context)
 {
+  riecoinWorkUnit_t* workUnit = (riecoinWorkUnit_t*)context;
 //  DPRINTF("Check restart\n");
-    if( verify_block->height != monitorCurrentBlockHeight ) {
+    if( workUnit->block.height != __atomic_load_n(&monitorCurrentBlockHeight, __ATOMIC_ACQUIRE) ) {
       DPRINTF("Restart (height)\n");
       return 1;
     }
   return 0;
 }
 
-void reportSuccess(mpz_t candidate, unsigned nPrimes)
+// Found tuples of 4 or more are checked again with a base 3 Fermat test
+// of every member before being submitted.  Blocks are always verified, on
+// the thread that found them, as six powm take far less time than the
+// round trip to the pool.  Shares are verified one in verifyShareInterval
+// by a pool of low priority threads, so the testers never wait for them.
+#define VERIFY_THREADS		(2)
+#define VERIFY_QUEUE_SIZE	(32)
+
+typedef struct
+{
+	minerRiecoinBlock_t block;
+	uint8 nOffset[32];
+	mpz_t candidate;
+	unsigned nPrimes;
+}riecoinVerifyJob_t;
+
+// Numbers for verifying, sized on each thread's first tuple
+typedef struct
+{
+	mpz_t member, testpow, testres, three;
+	bool ready;
+}riecoinVerifier_t;
+
+__thread riecoinVerifier_t verifier;
+
+ts_queue<riecoinVerifyJob_t*, VERIFY_QUEUE_SIZE> verifyQueue;
+ts_queue<riecoinVerifyJob_t*, VERIFY_QUEUE_SIZE> freeVerifyJobs;
+uint32 verifyShareInterval;
+__thread uint32 unverifiedShareCount; // each thread samples its own shares
+
+void riecoin_submit(minerRiecoinBlock_t* block, uint8* nOffset, unsigned nPrimes, uint64 timeFound)
+{
+	rh_statsInc(RH_STAT_SHARES);
+	DPRINTF("Submitting share\n");
+	xptMiner_submitShare(block, nOffset, nPrimes >= 6, timeFound);
+}
+
+/*
+ * Returns how many members of the tuple starting at candidate pass a base 3 Fermat test
+ */
+unsigned riecoin_verifyTuple(mpz_t candidate)
+{
+	static const unsigned memberOffset[6] = {0, 4, 6, 10, 12, 16};
+	if( !verifier.ready )
+	{
+		mpz_init2(verifier.member, RH_MPZ_BITS);
+		mpz_init2(verifier.testpow, RH_MPZ_BITS);
+		mpz_init2(verifier.testres, RH_MPZ_BITS);
+		mpz_init_set_ui(verifier.three, 3);
+		verifier.ready = true;
+	}
+	unsigned vPrimes = 0;
+	for(uint32 m=0; m<6; m++)
+	{
+		mpz_add_ui(verifier.member, candidate, memberOffset[m]);
+		mpz_sub_ui(verifier.testpow, verifier.member, 1);
+		mpz_powm(verifier.testres, verifier.three, verifier.testpow, verifier.member);
+		if (mpz_cmp_ui(verifier.testres, 1) == 0) vPrimes++;
+	}
+	return vPrimes;
+}
+
+/*
+ * Counts the verify result, returning true if the tuple is as good as reported
+ */
+bool riecoin_checkVerified(unsigned vPrimes, unsigned nPrimes)
+{
+	DPRINTF("Verified: %d, reported: %d\n", vPrimes, nPrimes);
+	if( vPrimes >= nPrimes )
+	{
+		rh_statsInc(RH_STAT_VERIFIED);
+		return true;
+	}
+	rh_statsInc(RH_STAT_VERIFY_REJECTED);
+	printf("Rejected tuple: %d primes reported, %d verified\n", nPrimes, vPrimes);
+	return false;
+}
+
+#ifdef _WIN32
+int riecoin_verifyThread(int threadIndex)
+{
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#else
+void *riecoin_verifyThread(void *)
+{
+#ifdef __linux__
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+#endif
+	while( true )
+	{
+		riecoinVerifyJob_t* job = verifyQueue.pop_front();
+		if( riecoin_checkVerified(riecoin_verifyTuple(job->candidate), job->nPrimes) )
+			riecoin_submit(&job->block, job->nOffset, job->nPrimes, 0);
+		freeVerifyJobs.push_back(job);
+	}
+	return 0;
+}
+
+void reportSuccess(void* context, mpz_t candidate, unsigned nPrimes)
 {
-  EnterCriticalSection(&success_lock);
+  riecoinWorkUnit_t* workUnit = (riecoinWorkUnit_t*)context;
+  minerRiecoinBlock_t* verify_block = &workUnit->block;
+  uint64 timeFound = getTimeHighRes();
   DPRINTF("Success %c %d\n", (nPrimes & 0x10) ? 'E' : 'A', nPrimes&0xf);
   nPrimes &= 0xf;
-#if 0
-  mpz_t testpow, testres, three;
-  mpz_init(testpow);
-  mpz_init(testres);
-  mpz_init_set_ui(three, 3);
-
-  unsigned vPrimes = 0;
-  mpz_sub_ui(testpow, candidate, 1);
-  mpz_powm(testres, three, testpow, candidate);
-  if (mpz_cmp_ui(testres, 1) == 0) vPrimes++;
-
-  mpz_add_ui(testpow, testpow, 4);
-  mpz_add_ui(candidate, candidate, 4);
-  mpz_powm(testres, three, testpow, candidate);
-  if (mpz_cmp_ui(testres, 1) == 0) vPrimes++;
-
-  mpz_add_ui(testpow, testpow, 2);
-  mpz_add_ui(candidate, candidate, 2);
-  mpz_powm(testres, three, testpow, candidate);
-  if (mpz_cmp_ui(testres, 1) == 0) vPrimes++;
-
-  mpz_add_ui(testpow, testpow, 4);
-  mpz_add_ui(candidate, candidate, 4);
-  mpz_powm(testres, three, testpow, candidate);
-  if (mpz_cmp_ui(testres, 1) == 0) vPrimes++;
-
-  mpz_add_ui(testpow, testpow, 2);
-  mpz_add_ui(candidate, candidate, 2);
-  mpz_powm(testres, three, testpow, candidate);
-  if (mpz_cmp_ui(testres, 1) == 0) vPrimes++;
-
-  mpz_add_ui(testpow, testpow, 4);
-  mpz_add_ui(candidate, candidate, 4);
-  mpz_powm(testres, three, testpow, candidate);
-  if (mpz_cmp_ui(testres, 1) == 0) vPrimes++;
-
-  mpz_clear(testpow);
-  mpz_clear(testres);
-  mpz_clear(three);
-
-  DPRINTF("Verified: %d, reported: %d\n", vPrimes, nPrimes);
-  if (vPrimes < nPrimes)
-  {
-    DPRINTF("ERROR!!\n");
-    LeaveCriticalSection(&success_lock);
-    return;
-  }
-#endif
-  mpz_t reportValue;
-  mpz_init(reportValue);
-  mpz_sub(reportValue, candidate, z_target);
+  if (reportValue->_mp_alloc == 0)
+    mpz_init2(reportValue, RH_MPZ_BITS);
+  mpz_sub(reportValue, candidate, workUnit->target);
   if (reportValue->_mp_size > 8)
   {
     DPRINTF("Report too large: %d limbs\n", reportValue->_mp_size);
     return;
   }
 
-	if (nPrimes >= 2) total2ChainCount++;
-	if (nPrimes >= 3) total3ChainCount++;
-	if (nPrimes >= 4) total4ChainCount++;
+	if (nPrimes >= 2) rh_statsInc(RH_STAT_2CH);
+	if (nPrimes >= 3) rh_statsInc(RH_STAT_3CH);
+	if (nPrimes >= 4) rh_statsInc(RH_STAT_4CH);
 	
-	if (nPrimes < 4) goto EXIT_LABEL;
+	if (nPrimes < 4) return;
 
 	// submit share
 	uint8 nOffset[32];
@@ -107,25 +168,101 @@ void reportSuccess(mpz_t candidate, unsigned nPrimes)
 	  {
 	    *(uint32*)(nOffset+d*4) = reportValue->_mp_d[d];
 	  }
-	totalShareCount++;
-    DPRINTF("Submitting share\n");
-	xptMiner_submitShare(verify_block, nOffset);
-EXIT_LABEL:
-    mpz_clear(reportValue);
-    LeaveCriticalSection(&success_lock);
+
+	// block solutions are verified here and go out before anything else is done with them
+	if( nPrimes >= 6 )
+	{
+		if( riecoin_checkVerified(riecoin_verifyTuple(candidate), nPrimes) )
+			riecoin_submit(verify_block, nOffset, nPrimes, timeFound);
+		return;
+	}
+
+	// hand over to the verify threads if the policy asks for it, never waiting for them
+	if( verifyShareInterval > 0 && ++unverifiedShareCount >= verifyShareInterval )
+	{
+		riecoinVerifyJob_t* job;
+		if( freeVerifyJobs.try_pop_front(job) )
+		{
+			unverifiedShareCount = 0;
+			memcpy(&job->block, verify_block, sizeof(minerRiecoinBlock_t));
+			memcpy(job->nOffset, nOffset, 32);
+			mpz_set(job->candidate, candidate);
+			job->nPrimes = nPrimes;
+			verifyQueue.push_back(job);
+			return;
+		}
+	}
+	riecoin_submit(verify_block, nOffset, nPrimes, timeFound);
 }
 
-void riecoin_init(uint64_t, int)
+void riecoin_init(uint64_t, int numThreads, int numEngines, uint32 verifyInterval)
 {
   DPRINTF("Init Entry\n");
-  InitializeCriticalSection(&success_lock);
-  rh_oneTimeInit(reportSuccess, checkRestart);
+  verifyShareInterval = verifyInterval;
+  for(uint32 i=0; i<VERIFY_QUEUE_SIZE; i++)
+  {
+    riecoinVerifyJob_t* job = (riecoinVerifyJob_t*)malloc(sizeof(riecoinVerifyJob_t));
+    mpz_init2(job->candidate, RH_MPZ_BITS);
+    freeVerifyJobs.push_back(job);
+  }
+  for(uint32 i=0; i<VERIFY_THREADS; i++)
+  {
+#ifdef _WIN32
+    CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)riecoin_verifyThread, (LPVOID)0, 0, NULL);
+#else
+    pthread_t verifyThread;
+    pthread_create(&verifyThread, NULL, riecoin_verifyThread, NULL);
+    pthread_detach(verifyThread);
+#endif
+  }
+  rh_oneTimeInit(reportSuccess, checkRestart, numThreads, numEngines);
 }
 
-void riecoin_process(minerRiecoinBlock_t* block)
+riecoinWorkUnit_t* riecoin_createWorkUnit()
 {
+	riecoinWorkUnit_t* workUnit = (riecoinWorkUnit_t*)malloc(sizeof(riecoinWorkUnit_t));
+	mpz_init2(workUnit->target, RH_MPZ_BITS);
+	workUnit->searchUnit = rh_createWorkUnit();
+	return workUnit;
+}
+
+static uint32 reverseBits(uint32 x)
+{
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+	x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Recently prepared targets, by a hash of the header and search bits.  A
+// slot only keeps the last target hashed to it, so this catches repeats
+// of recent work rather than every repeat ever.
+#define RECENT_TARGETS	(4096)
+static uint64 recentTargets[RECENT_TARGETS];
+
+/*
+ * Remembers a target, returning true if it was already there
+ */
+static bool riecoin_isDuplicateTarget(const uint8* powHash, uint32 searchBits)
+{
+	uint64 key;
+	memcpy(&key, powHash, sizeof(key));
+	key ^= (uint64)searchBits * 0x9E3779B97F4A7C15ull;
+	if( key == 0 )
+		key = 1;
+	return __atomic_exchange_n(&recentTargets[key % RECENT_TARGETS], key, __ATOMIC_RELAXED) == key;
+}
+
+/*
+ * Hashes the block header and computes the target and sieve setup for it.
+ * Doesn't touch any state used by a running search, so can run on another thread.
+ * Returns false, without setting up the search, if the target was searched recently.
+ */
+bool riecoin_prepareWorkUnit(riecoinWorkUnit_t* workUnit)
+{
+	minerRiecoinBlock_t* block = &workUnit->block;
 	uint32 searchBits = block->targetCompact;
-	verify_block = block;
 
 	// test data
 	// getblock 16ee31c116b75d0299dc03cab2b6cbcb885aa29adf292b2697625bc9d28b2b64
@@ -144,22 +281,32 @@ void riecoin_process(minerRiecoinBlock_t* block)
 	sha256_init(&ctx);
 	sha256_update(&ctx, powHash, 32);
 	sha256_final(&ctx, powHash);
-	// generatePrimeBase
-	uint32* powHashU32 = (uint32*)powHash;
-
-	mpz_init_set_ui(z_target, 1);
-	mpz_mul_2exp(z_target, z_target, zeroesBeforeHashInPrime);
-	for(uint32 i=0; i<256; i++)
+	if( riecoin_isDuplicateTarget(powHash, searchBits) )
 	{
-		mpz_mul_2exp(z_target, z_target, 1);
-		if( (powHashU32[i/32]>>(i%32))&1 )
-			z_target->_mp_d[0]++;
+		rh_statsInc(RH_STAT_DUPLICATE_TARGETS);
+		return false;
 	}
+	// generatePrimeBase
+	// The target is a one bit, zeroesBeforeHashInPrime zeroes, then the
+	// hash taken from its least significant bit, then trailingZeros zeroes
+	uint32* powHashU32 = (uint32*)powHash;
+	uint32 targetU32[9];
+	targetU32[8] = 1 << zeroesBeforeHashInPrime;
+	for(uint32 i=0; i<8; i++)
+		targetU32[7-i] = reverseBits(powHashU32[i]);
+	mpz_import(workUnit->target, 9, -1, sizeof(uint32), 0, 0, targetU32);
 	unsigned int trailingZeros = searchBits - 1 - zeroesBeforeHashInPrime - 256;
-  DPRINTF("Process Entry %lx %d\n", z_target->_mp_d[0], trailingZeros);
-	mpz_mul_2exp(z_target, z_target, trailingZeros);
+  DPRINTF("Process Entry %lx %d\n", workUnit->target->_mp_d[0], trailingZeros);
+	mpz_mul_2exp(workUnit->target, workUnit->target, trailingZeros);
 
-	rh_search(z_target);
+	rh_prepareWorkUnit(workUnit->searchUnit, workUnit->target);
+	return true;
+}
 
-	mpz_clear(z_target);
+/*
+ * Searches a prepared work unit on the given engine, from that engine's miner thread.
+ */
+void riecoin_processWorkUnit(riecoinWorkUnit_t* workUnit, int engine)
+{
+	rh_searchWorkUnit(rh_getEngine(engine), workUnit->searchUnit, workUnit);
 }
@@ -212,8 +212,8 @@ uint64 sha512_k[80] =
 
 /* SHA-256 functions */
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+static void sha256_transf_generic(sha256_ctx *ctx, const unsigned char *message,
+                                  unsigned int block_nb)
 {
     uint32 w[64];
     uint32 wv[8];
@@ -327,6 +327,350 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
     }
 }
 
+/* Hardware SHA-256 kernels, chosen at the first hash from what the CPU
+ * supports.  They take the same state and blocks as sha256_transf_generic,
+ * and are built with target attributes so the rest of the file needs no
+ * special flags. */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_transf_shani(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp, abef_save, cdgh_save;
+    __m128i w[4];
+    int i, j;
+
+    /* The instructions want the state as ABEF and CDGH */
+    tmp = _mm_loadu_si128((const __m128i *) &ctx->h[0]);
+    state1 = _mm_loadu_si128((const __m128i *) &ctx->h[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (i = 0; i < (int) block_nb; i++) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        for (j = 0; j < 4; j++) {
+            w[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)
+                                    (message + (i << 6) + (j << 4))), mask);
+        }
+
+        /* Four rounds at a time, scheduling the words four groups ahead */
+        for (j = 0; j < 16; j++) {
+            msg = _mm_add_epi32(w[j & 3],
+                  _mm_loadu_si128((const __m128i *) &sha256_k[j << 2]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+            if (j < 12) {
+                tmp = _mm_sha256msg1_epu32(w[j & 3], w[(j + 1) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(j + 3) & 3],
+                                                         w[(j + 2) & 3], 4));
+                w[j & 3] = _mm_sha256msg2_epu32(tmp, w[(j + 3) & 3]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *) &ctx->h[0], state0);
+    _mm_storeu_si128((__m128i *) &ctx->h[4], state1);
+}
+
+#define SHA256_X8_ROTR(x, n) \
+    _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define SHA256_X8_F1(x) _mm256_xor_si256(SHA256_X8_ROTR(x,  2), \
+    _mm256_xor_si256(SHA256_X8_ROTR(x, 13), SHA256_X8_ROTR(x, 22)))
+#define SHA256_X8_F2(x) _mm256_xor_si256(SHA256_X8_ROTR(x,  6), \
+    _mm256_xor_si256(SHA256_X8_ROTR(x, 11), SHA256_X8_ROTR(x, 25)))
+#define SHA256_X8_F3(x) _mm256_xor_si256(SHA256_X8_ROTR(x,  7), \
+    _mm256_xor_si256(SHA256_X8_ROTR(x, 18), _mm256_srli_epi32(x,  3)))
+#define SHA256_X8_F4(x) _mm256_xor_si256(SHA256_X8_ROTR(x, 17), \
+    _mm256_xor_si256(SHA256_X8_ROTR(x, 19), _mm256_srli_epi32(x, 10)))
+
+/* One block of eight messages at once, a lane each.  h and w are
+ * indexed by word then lane. */
+__attribute__((target("avx2")))
+static void sha256_transf_avx2_x8(uint32 h[8][8], const uint32 block[16][8])
+{
+    __m256i w[16];
+    __m256i wv[8];
+    __m256i t1, t2;
+    int j;
+
+    for (j = 0; j < 8; j++) {
+        wv[j] = _mm256_load_si256((const __m256i *) h[j]);
+    }
+
+    for (j = 0; j < 64; j++) {
+        if (j < 16) {
+            w[j] = _mm256_load_si256((const __m256i *) block[j]);
+        } else {
+            w[j & 15] = _mm256_add_epi32(
+                _mm256_add_epi32(SHA256_X8_F4(w[(j - 2) & 15]), w[(j - 7) & 15]),
+                _mm256_add_epi32(SHA256_X8_F3(w[(j - 15) & 15]), w[j & 15]));
+        }
+
+        t1 = _mm256_add_epi32(
+            _mm256_add_epi32(wv[7], SHA256_X8_F2(wv[4])),
+            _mm256_add_epi32(
+                _mm256_xor_si256(_mm256_and_si256(wv[4], wv[5]),
+                                 _mm256_andnot_si256(wv[4], wv[6])),
+                _mm256_add_epi32(_mm256_set1_epi32(sha256_k[j]), w[j & 15])));
+        t2 = _mm256_add_epi32(SHA256_X8_F1(wv[0]),
+            _mm256_or_si256(_mm256_and_si256(wv[0], wv[1]),
+                            _mm256_and_si256(wv[2], _mm256_or_si256(wv[0], wv[1]))));
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = _mm256_add_epi32(wv[3], t1);
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = _mm256_add_epi32(t1, t2);
+    }
+
+    for (j = 0; j < 8; j++) {
+        _mm256_store_si256((__m256i *) h[j], _mm256_add_epi32(wv[j],
+                           _mm256_load_si256((const __m256i *) h[j])));
+    }
+}
+
+static unsigned int sha256_detect(void)
+{
+    unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+    unsigned int features = 0;
+    unsigned int ssse3, sse41, osavx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    ssse3 = ecx & (1 << 9);
+    sse41 = ecx & (1 << 19);
+    osavx = 0;
+    if ((ecx & (1 << 27)) && (ecx & (1 << 28))) {
+        /* The OS saves the YMM registers */
+        __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+        osavx = (xcr0_lo & 6) == 6;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    if ((ebx & (1 << 29)) && ssse3 && sse41) {
+        features |= SHA256_SHANI;
+    }
+    if ((ebx & (1 << 5)) && osavx) {
+        features |= SHA256_AVX2;
+    }
+    return features;
+}
+
+#elif defined(__aarch64__)
+
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#ifdef __clang__
+__attribute__((target("crypto")))
+#else
+__attribute__((target("+crypto")))
+#endif
+static void sha256_transf_armv8(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb)
+{
+    uint32x4_t state0, state1, abcd_save, efgh_save, msg, tmp;
+    uint32x4_t w[4];
+    int i, j;
+
+    state0 = vld1q_u32(&ctx->h[0]);
+    state1 = vld1q_u32(&ctx->h[4]);
+
+    for (i = 0; i < (int) block_nb; i++) {
+        abcd_save = state0;
+        efgh_save = state1;
+
+        for (j = 0; j < 4; j++) {
+            w[j] = vreinterpretq_u32_u8(vrev32q_u8(
+                   vld1q_u8(message + (i << 6) + (j << 4))));
+        }
+
+        /* Four rounds at a time, scheduling the words four groups ahead */
+        for (j = 0; j < 16; j++) {
+            msg = vaddq_u32(w[j & 3], vld1q_u32(&sha256_k[j << 2]));
+            if (j < 12) {
+                w[j & 3] = vsha256su0q_u32(w[j & 3], w[(j + 1) & 3]);
+            }
+            tmp = state0;
+            state0 = vsha256hq_u32(state0, state1, msg);
+            state1 = vsha256h2q_u32(state1, tmp, msg);
+            if (j < 12) {
+                w[j & 3] = vsha256su1q_u32(w[j & 3], w[(j + 2) & 3],
+                                           w[(j + 3) & 3]);
+            }
+        }
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+    }
+
+    vst1q_u32(&ctx->h[0], state0);
+    vst1q_u32(&ctx->h[4], state1);
+}
+
+static unsigned int sha256_detect(void)
+{
+#if defined(__linux__) && defined(HWCAP_SHA2)
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) ? SHA256_ARMV8 : 0;
+#elif defined(__APPLE__) || defined(__ARM_FEATURE_CRYPTO)
+    return SHA256_ARMV8;
+#else
+    return 0;
+#endif
+}
+
+#else
+
+static unsigned int sha256_detect(void)
+{
+    return 0;
+}
+
+#endif
+
+#define SHA256_UNSET 0x80000000
+
+static unsigned int sha256_supported = SHA256_UNSET;
+static unsigned int sha256_active = SHA256_UNSET;
+
+unsigned int sha256_features(void)
+{
+    unsigned int features = __atomic_load_n(&sha256_supported, __ATOMIC_RELAXED);
+
+    if (features & SHA256_UNSET) {
+        features = sha256_detect();
+        __atomic_store_n(&sha256_supported, features, __ATOMIC_RELAXED);
+    }
+    return features;
+}
+
+unsigned int sha256_use(unsigned int features)
+{
+    features &= sha256_features();
+    __atomic_store_n(&sha256_active, features, __ATOMIC_RELAXED);
+    return features;
+}
+
+static inline unsigned int sha256_active_features(void)
+{
+    unsigned int features = __atomic_load_n(&sha256_active, __ATOMIC_RELAXED);
+
+    if (features & SHA256_UNSET) {
+        features = sha256_use(~0u);
+    }
+    return features;
+}
+
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (sha256_active_features() & SHA256_SHANI) {
+        sha256_transf_shani(ctx, message, block_nb);
+        return;
+    }
+#elif defined(__aarch64__)
+    if (sha256_active_features() & SHA256_ARMV8) {
+        sha256_transf_armv8(ctx, message, block_nb);
+        return;
+    }
+#endif
+    sha256_transf_generic(ctx, message, block_nb);
+}
+
+void sha256_x8(const unsigned char *message, unsigned int stride,
+               unsigned int len, unsigned int count, unsigned char *digest)
+{
+    unsigned int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+    /* The hardware kernels are faster one message at a time */
+    unsigned int features = sha256_active_features();
+    if ((features & SHA256_AVX2) && !(features & SHA256_SHANI)) {
+        uint32 h[8][8] __attribute__ ((aligned (32)));
+        uint32 w[16][8] __attribute__ ((aligned (32)));
+        unsigned char pad[SHA256_BLOCK_SIZE];
+        unsigned int block_nb = (len + 9 + SHA256_BLOCK_SIZE - 1) / SHA256_BLOCK_SIZE;
+        unsigned int n, b, j, lane, offset, rem_len;
+        const unsigned char *sub_block;
+
+        for (; count > 0; count -= n) {
+            n = count < 8 ? count : 8;
+            for (j = 0; j < 8; j++) {
+                for (lane = 0; lane < 8; lane++) {
+                    h[j][lane] = sha256_h0[j];
+                }
+            }
+
+            for (b = 0; b < block_nb; b++) {
+                offset = b << 6;
+                /* Spare lanes hash the first message again */
+                for (lane = 0; lane < 8; lane++) {
+                    sub_block = message + (lane < n ? lane : 0) * stride + offset;
+                    if (offset + SHA256_BLOCK_SIZE > len) {
+                        rem_len = len > offset ? len - offset : 0;
+                        memcpy(pad, sub_block, rem_len);
+                        memset(pad + rem_len, 0, SHA256_BLOCK_SIZE - rem_len);
+                        if (len >= offset) {
+                            pad[rem_len] = 0x80;
+                        }
+                        if (b == block_nb - 1) {
+                            UNPACK32(len << 3, pad + SHA256_BLOCK_SIZE - 4);
+                        }
+                        sub_block = pad;
+                    }
+                    for (j = 0; j < 16; j++) {
+                        PACK32(&sub_block[j << 2], &w[j][lane]);
+                    }
+                }
+                sha256_transf_avx2_x8(h, w);
+            }
+
+            for (lane = 0; lane < n; lane++) {
+                for (j = 0; j < 8; j++) {
+                    UNPACK32(h[j][lane], &digest[(lane << 5) + (j << 2)]);
+                }
+            }
+            message += n * stride;
+            digest += n * SHA256_DIGEST_SIZE;
+        }
+        return;
+    }
+#endif
+
+    for (i = 0; i < count; i++) {
+        sha256(message + i * stride, len, digest + i * SHA256_DIGEST_SIZE);
+    }
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
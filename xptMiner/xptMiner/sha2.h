@@ -86,6 +86,21 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
 
+/* Hardware support for SHA-256, which is used whenever the CPU has it */
+#define SHA256_SHANI 1      /* x86 SHA extensions */
+#define SHA256_ARMV8 2      /* ARMv8 crypto extensions */
+#define SHA256_AVX2  4      /* Eight messages at once in AVX2 registers */
+
+unsigned int sha256_features(void);
+/* Restricts SHA-256 to the given features, for testing, and returns
+ * those of them the CPU has */
+unsigned int sha256_use(unsigned int features);
+
+/* Hashes count messages of len bytes each, stride bytes apart, into
+ * consecutive digests.  Eight at a time where that is faster. */
+void sha256_x8(const unsigned char *message, unsigned int stride,
+               unsigned int len, unsigned int count, unsigned char *digest);
+
 void sha384_init(sha384_ctx *ctx);
 void sha384_update(sha384_ctx *ctx, const unsigned char *message,
                    unsigned int len);
@@ -0,0 +1,115 @@
+#include "rh_fermat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+// Compares the fixed width Fermat kernels against mpz_powm on the same
+// candidates, checking they agree and reporting tests/s for each.
+// Usage: testfermat [bits [candidates]]
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char* argv[])
+{
+  int bits = argc > 1 ? atoi(argv[1]) : 1480;
+  int count = argc > 2 ? atoi(argv[2]) : 200;
+
+  gmp_randstate_t rnd;
+  gmp_randinit_default(rnd);
+
+  // Half the candidates are primes so both outcomes are exercised
+  mpz_t* candidates = new mpz_t[count];
+  for (int i = 0; i < count; ++i)
+  {
+    mpz_init(candidates[i]);
+    mpz_urandomb(candidates[i], rnd, bits - 1);
+    mpz_setbit(candidates[i], bits - 1);
+    if (i & 1) mpz_nextprime(candidates[i], candidates[i]);
+    else mpz_setbit(candidates[i], 0);
+  }
+
+  mp_size_t limbs = mpz_size(candidates[0]);
+  rh_fermatTest_t fermatTest = rh_selectFermatTest(limbs);
+
+  mpz_t two, testpow, testres;
+  mpz_init_set_ui(two, 2);
+  mpz_init(testpow);
+  mpz_init(testres);
+
+  // Best of several rounds, as timings on a busy machine are noisy
+  char* gmpResults = new char[count];
+  double gmpTime = 0, fixedTime = 0;
+  int mismatches = 0, primes = 0;
+  for (int round = 0; round < 5; ++round)
+  {
+    double start = now();
+    for (int i = 0; i < count; ++i)
+    {
+      mpz_sub_ui(testpow, candidates[i], 1);
+      mpz_powm(testres, two, testpow, candidates[i]);
+      gmpResults[i] = mpz_cmp_ui(testres, 1) == 0;
+    }
+    double t = now() - start;
+    if (round == 0 || t < gmpTime) gmpTime = t;
+
+    if (!fermatTest) continue;
+    mismatches = primes = 0;
+    start = now();
+    for (int i = 0; i < count; ++i)
+    {
+      int result = fermatTest(candidates[i]->_mp_d);
+      primes += result;
+      mismatches += result != gmpResults[i];
+    }
+    t = now() - start;
+    if (round == 0 || t < fixedTime) fixedTime = t;
+  }
+
+  printf("%d bits (%d limbs), %d candidates\n", bits, (int)limbs, count);
+  printf("GMP:         %.0f tests/s\n", count / gmpTime);
+  if (fermatTest)
+    printf("Fixed width: %.0f tests/s (%.2fx), %d probable primes\n", count / fixedTime, gmpTime / fixedTime, primes);
+  else
+    printf("Fixed width: no kernel for %d limbs\n", (int)limbs);
+
+  // Batch kernels, fed in batches of their lane count
+  mp_srcptr* numbers = new mp_srcptr[count];
+  int* results = new int[count];
+  for (int i = 0; i < count; ++i) numbers[i] = candidates[i]->_mp_d;
+  for (unsigned kernel = 0; rh_fermatBatchNames[kernel]; ++kernel)
+  {
+    unsigned lanes;
+    rh_fermatBatch_t batch = rh_getFermatBatch(kernel, limbs, &lanes);
+    if (!batch)
+    {
+      printf("%s: not supported\n", rh_fermatBatchNames[kernel]);
+      continue;
+    }
+
+    double batchTime = 0;
+    int batchMismatches = 0;
+    for (int round = 0; round < 5; ++round)
+    {
+      double start = now();
+      for (int i = 0; i < count; i += lanes)
+        batch(numbers + i, limbs, count - i < (int)lanes ? count - i : lanes, results + i);
+      double t = now() - start;
+      if (round == 0 || t < batchTime) batchTime = t;
+    }
+    for (int i = 0; i < count; ++i)
+      batchMismatches += (results[i] != 0) != gmpResults[i];
+    printf("%s (%u lanes): %.0f tests/s (%.2fx)\n", rh_fermatBatchNames[kernel], lanes, count / batchTime, gmpTime / batchTime);
+    mismatches += batchMismatches;
+  }
+  if (mismatches)
+  {
+    printf("FAILED: %d results differ from GMP\n", mismatches);
+    return 1;
+  }
+  return 0;
+}
@@ -3,23 +3,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include "rh_riecoin.h"
-
-void riecoin_init(uint64_t, int);
-extern "C" void rh_search(mpz_t target);
+#include "rh_alloc.h"
+#include "rh_stats.h"
 
 volatile uint32_t monitorCurrentBlockHeight; // used to notify worker threads of new block data
 volatile uint32_t monitorCurrentBlockTime; // keeps track of current block time, used to detect if current work data is outdated
 
-// stats
-volatile uint32_t totalShareCount = 0;
-volatile uint32_t totalRejectedShareCount = 0;
-volatile uint32_t total2ChainCount = 0;
-volatile uint32_t total3ChainCount = 0;
-volatile uint32_t total4ChainCount = 0;
 
 typedef uint32_t uint32;
 typedef uint8_t uint8;
-typedef uint64_t uint64;
+typedef unsigned long long uint64;
 
 typedef struct
 {
@@ -31,7 +24,7 @@ typedef struct
         uint64  nTime; // Riecoin has 64bit timestamps
         uint8   nOffset[32];
         // remaining data
-        uint32  uniqueMerkleSeed;
+        uint64  uniqueMerkleSeed; // the extra nonce
         uint32  height;
         uint8   merkleRootOriginal[32]; // used to identify work
         // uint8        target[32];
@@ -41,45 +34,95 @@ typedef struct
         uint32  shareTargetCompact;
 }minerRiecoinBlock_t;
 
-extern minerRiecoinBlock_t* verify_block;
-extern mpz_t z_target;
+// As in algorithm.h, which needs the rest of the miner
+typedef struct
+{
+	minerRiecoinBlock_t block;
+	mpz_t target;
+	struct rh_workUnit_s* searchUnit;
+}riecoinWorkUnit_t;
 
-void xptMiner_submitShare(minerRiecoinBlock_t*, uint8*)
+void riecoin_init(uint64_t, int, int, uint32_t);
+riecoinWorkUnit_t* riecoin_createWorkUnit();
+void riecoin_processWorkUnit(riecoinWorkUnit_t*, int);
+
+void xptMiner_submitShare(minerRiecoinBlock_t*, uint8*, bool, uint64)
 {}
 
+uint64_t getTimeHighRes(void)
+{
+  return 0;
+}
+
+// GMP allocations made by a search, which should all come from the
+// arenas once the first search has warmed them up.
+static void printAllocs()
+{
+  static rh_allocStats_t last;
+  rh_allocStats_t stats;
+  rh_getAllocStats(&stats);
+  printf("GMP allocations: %llu, %llu from the heap\n",
+         (unsigned long long)(stats.allocs - last.allocs),
+         (unsigned long long)(stats.heapAllocs - last.heapAllocs));
+  last = stats;
+}
+
+static void printFound()
+{
+  printf("Found (%llu, %llu, %llu)\n",
+         (unsigned long long)rh_statsGet(RH_STAT_2CH),
+         (unsigned long long)rh_statsGet(RH_STAT_3CH),
+         (unsigned long long)rh_statsGet(RH_STAT_4CH));
+}
+
+// Searches the target in the unit on the first engine
+static void search(riecoinWorkUnit_t* workUnit)
+{
+  rh_prepareWorkUnit(workUnit->searchUnit, workUnit->target);
+  riecoin_processWorkUnit(workUnit, 0);
+}
+
 int main(int argc, char* argv[])
 {
-  minerRiecoinBlock_t block;
   monitorCurrentBlockHeight = 1200;
-  block.height = 1200;
-  verify_block = &block;
 
-  riecoin_init(0, 0); 
+  rh_allocInit();
+  riecoin_init(0, 0, 1, 0); 
+  printAllocs();
+
+  riecoinWorkUnit_t* workUnit = riecoin_createWorkUnit();
+  workUnit->block.height = 1200;
+  mpz_ptr z_target = workUnit->target;
 
   if (argc < 3)
   {
-    mpz_init_set_str(z_target, "2001617f4d78f05f0787e8ed9dd5c0d03df3f36098fc9fe1270772ecd697b0a94a0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000", 16);
+    mpz_set_str(z_target, "2001617f4d78f05f0787e8ed9dd5c0d03df3f36098fc9fe1270772ecd697b0a94a0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000", 16);
 
-    rh_search(z_target);
+    search(workUnit);
 
-    printf("Found (%d, %d, %d)\n", total2ChainCount, total3ChainCount, total4ChainCount);
+    printFound();
+    printAllocs();
   } 
   else
   {
     int min = atoi(argv[1]);
     int max = atoi(argv[2]);
 
-    mpz_init_set_str(z_target, "2001617f4d78f05f0787e8ed9dd5c0d03df3f36098fc9fe1270772ecd697b0a94a", 16);
+    mpz_set_str(z_target, "2001617f4d78f05f0787e8ed9dd5c0d03df3f36098fc9fe1270772ecd697b0a94a", 16);
 
     mpz_mul_2exp(z_target, z_target, min);
 
     for (int i = min; i <= max; ++i)
     {
-      rh_search(z_target);
+      search(workUnit);
 
-      printf("i=%d: Found (%d, %d, %d)\n", i, total2ChainCount, total3ChainCount, total4ChainCount);
+      printf("i=%d: ", i);
+      printFound();
+      printAllocs();
 
-      total2ChainCount = total3ChainCount = total4ChainCount = 0;
+      rh_statsReset(RH_STAT_2CH);
+      rh_statsReset(RH_STAT_3CH);
+      rh_statsReset(RH_STAT_4CH);
       mpz_mul_2exp(z_target, z_target, 1);
     }
   }
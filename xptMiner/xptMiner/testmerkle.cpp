@@ -0,0 +1,108 @@
+#include "global.h"
+#include <sys/time.h>
+
+// Checks that merkle roots worked out from the coinbase's branch match
+// the full tree, and compares the cost of each for a new extra nonce.
+// Usage: testmerkle [work units]
+
+#define MAX_TX 4096
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static uint8 coinBase1[128], coinBase2[128];
+static uint8 txHashes[32 * (MAX_TX + 1)];
+static uint8 scratch[32 * (MAX_TX + 1)];
+
+// The coinbase hash and root for extra nonce seed, from the whole tree
+static void fullRoot(uint64 seed, uint32 numTx, uint8* merkleRoot)
+{
+  bitclient_generateTxHash(sizeof(seed), (uint8*)&seed, sizeof(coinBase1), coinBase1, sizeof(coinBase2), coinBase2, txHashes, TX_MODE_DOUBLE_SHA256);
+  bitclient_calculateMerkleRoot(txHashes, numTx + 1, merkleRoot, TX_MODE_DOUBLE_SHA256);
+}
+
+// The same from the branch, and coinBase1 hashed once, as the miner does
+static void branchRoot(uint64 seed, uint8* branch, uint32 branchLength, uint8* merkleRoot)
+{
+  static sha256_ctx coinBase1State;
+  static bool prepared = false;
+  if (!prepared)
+  {
+    bitclient_prepareCoinBase(&coinBase1State, sizeof(coinBase1), coinBase1);
+    prepared = true;
+  }
+  uint8 coinbaseHash[32];
+  bitclient_generateTxHashFromState(&coinBase1State, sizeof(seed), (uint8*)&seed, sizeof(coinBase2), coinBase2, coinbaseHash, TX_MODE_DOUBLE_SHA256);
+  bitclient_calculateMerkleRootFromBranch(coinbaseHash, branch, branchLength, merkleRoot, TX_MODE_DOUBLE_SHA256);
+}
+
+static uint32 makeBranch(uint32 numTx, uint8* branch)
+{
+  memcpy(scratch, txHashes, 32 * (numTx + 1));
+  return bitclient_calculateMerkleBranch(scratch, numTx + 1, branch, TX_MODE_DOUBLE_SHA256);
+}
+
+int main(int argc, char* argv[])
+{
+  int units = argc > 1 ? atoi(argv[1]) : 2000;
+  if (units < 1) units = 2000;
+
+  srand(1);
+  for (uint32 i = 0; i < sizeof(coinBase1); ++i) coinBase1[i] = rand();
+  for (uint32 i = 0; i < sizeof(coinBase2); ++i) coinBase2[i] = rand();
+  for (uint32 i = 0; i < sizeof(txHashes); ++i) txHashes[i] = rand();
+
+  // Every size up to a few layers, powers of two either side, and the largest
+  int failures = 0;
+  static const uint32 sizes[] = { 63, 64, 65, 127, 128, 129, 1023, 1024, 1025, MAX_TX };
+  for (uint32 k = 0; k < 40 + sizeof(sizes) / sizeof(sizes[0]); ++k)
+  {
+    uint32 numTx = k < 40 ? k : sizes[k - 40];
+    uint8 branch[32 * MAX_MERKLE_BRANCH];
+    uint32 branchLength = makeBranch(numTx, branch);
+    for (uint64 seed = 1; seed <= 3; ++seed)
+    {
+      uint8 expected[32], actual[32];
+      fullRoot(seed, numTx, expected);
+      branchRoot(seed, branch, branchLength, actual);
+      if (memcmp(expected, actual, 32) != 0)
+      {
+        printf("FAIL: %u transactions, seed %u\n", numTx, (unsigned)seed);
+        failures++;
+      }
+    }
+  }
+
+  printf("%-14s %8s %14s %14s %8s\n", "transactions", "branch", "full us/unit", "branch us/unit", "speedup");
+  static const uint32 benchSizes[] = { 1, 100, MAX_TX };
+  for (uint32 k = 0; k < sizeof(benchSizes) / sizeof(benchSizes[0]); ++k)
+  {
+    uint32 numTx = benchSizes[k];
+    uint8 merkleRoot[32], branch[32 * MAX_MERKLE_BRANCH];
+    uint32 branchLength = makeBranch(numTx, branch);
+
+    double start = now();
+    for (int i = 0; i < units; ++i)
+      fullRoot(i, numTx, merkleRoot);
+    double full = (now() - start) * 1000000.0 / units;
+
+    start = now();
+    for (int i = 0; i < units; ++i)
+      branchRoot(i, branch, branchLength, merkleRoot);
+    double fromBranch = (now() - start) * 1000000.0 / units;
+
+    printf("%-14u %8u %14.2f %14.2f %7.1fx\n", numTx, branchLength, full, fromBranch, full / fromBranch);
+  }
+
+  if (failures)
+  {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
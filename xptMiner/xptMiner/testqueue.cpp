@@ -1,34 +1,284 @@
 #include "tsqueue.hpp"
-#include <iostream>
+#include <deque>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
-ts_queue<int, 2000> tq;
+// Stress test and throughput benchmark for ts_queue.
+// Usage: testqueue [items per producer]
 
-void *producer_thread(void *arg) {
-  for (int i = 0; i < 3000; i++) {
-    tq.push_back(1);
+#define QUEUE_SIZE 1024
+#define MAX_THREADS 16
+#define DONE 0xffffffffu
+
+typedef ts_queue<uint32_t, QUEUE_SIZE> queue_t;
+
+static double now() {
+  struct timespec tv;
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return tv.tv_sec + tv.tv_nsec / 1000000000.0;
+}
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+    failures++;
   }
-  printf("Producer thread put 3000 on stack\n");
-  return NULL;
 }
 
-void *consumer_thread(void *arg) {
-  sleep(2);
-  for (int i = 0; i < 1000; i++) {
-    tq.pop_front();
+// Items are producer << 24 | sequence, so each consumer can check that
+// every producer's items reach it in order
+struct run_t {
+  queue_t* q;
+  unsigned producer;
+  unsigned items;
+  unsigned batch;
+  unsigned producers;
+  uint64_t sum;
+  uint64_t count;
+  bool ordered;
+};
+
+static void *producer_thread(void *arg) {
+  run_t* run = (run_t*)arg;
+  uint32_t items[64];
+  for (unsigned i = 1; i <= run->items; ) {
+    unsigned n = 0;
+    while (n < run->batch && i <= run->items)
+      items[n++] = run->producer << 24 | i++;
+    if (n == 1) run->q->push_back(items[0]);
+    else run->q->push_back_n(items, n);
   }
-  printf("Consumer thread got 1000\n");
   return NULL;
 }
 
-int main() {
-  pthread_t threads[4];
-  pthread_create(&threads[0], NULL, producer_thread, NULL);
-  sleep(1);
-  printf("After 1 second of producer running, tq.size is: %d\n", tq.size());
-  for (int i = 1; i < 4; i++) {
-    pthread_create(&threads[i], NULL, consumer_thread, NULL);
+static void *consumer_thread(void *arg) {
+  run_t* run = (run_t*)arg;
+  uint32_t last[MAX_THREADS] = {0};
+  uint32_t items[64];
+  while (true) {
+    size_t n = run->batch == 1 ? (items[0] = run->q->pop_front(), 1) : run->q->pop_front_n(items, run->batch);
+    for (size_t i = 0; i < n; ++i) {
+      if (items[i] == DONE) {
+        // Anything after it is another consumer's DONE
+        if (i + 1 < n) run->q->push_back_n(items + i + 1, n - i - 1);
+        return NULL;
+      }
+      unsigned producer = items[i] >> 24;
+      uint32_t seq = items[i] & 0xffffff;
+      if (producer >= run->producers || seq <= last[producer]) run->ordered = false;
+      else last[producer] = seq;
+      run->sum += items[i];
+      run->count++;
+    }
   }
-  for (int i = 0; i < 4; i++) {
+}
+
+// Runs producers and consumers over one queue, returning items per second
+static double runQueue(unsigned producers, unsigned consumers, unsigned items, unsigned batch) {
+  queue_t queue;
+  queue_t* q = &queue;
+  run_t prod[MAX_THREADS], cons[MAX_THREADS];
+  pthread_t threads[2 * MAX_THREADS];
+  uint64_t expectSum = 0;
+
+  double start = now();
+  for (unsigned i = 0; i < consumers; ++i) {
+    cons[i] = run_t{ q, 0, 0, batch, producers, 0, 0, true };
+    pthread_create(&threads[producers + i], NULL, consumer_thread, &cons[i]);
+  }
+  for (unsigned i = 0; i < producers; ++i) {
+    prod[i] = run_t{ q, i, items, batch, producers, 0, 0, true };
+    pthread_create(&threads[i], NULL, producer_thread, &prod[i]);
+    for (unsigned k = 1; k <= items; ++k)
+      expectSum += i << 24 | k;
+  }
+  for (unsigned i = 0; i < producers; ++i)
     pthread_join(threads[i], NULL);
+  // Each consumer stops at the first DONE it sees
+  for (unsigned i = 0; i < consumers; ++i)
+    q->push_back(DONE);
+  for (unsigned i = 0; i < consumers; ++i)
+    pthread_join(threads[producers + i], NULL);
+  double elapsed = now() - start;
+
+  uint64_t sum = 0, count = 0;
+  bool ordered = true;
+  for (unsigned i = 0; i < consumers; ++i) {
+    sum += cons[i].sum;
+    count += cons[i].count;
+    ordered = ordered && cons[i].ordered;
+  }
+  char what[96];
+  snprintf(what, sizeof(what), "%u producers %u consumers batch %u", producers, consumers, batch);
+  check(count == (uint64_t)producers * items, what);
+  check(sum == expectSum, what);
+  check(ordered, what);
+  check(q->size() == 0, what);
+  return count / elapsed;
+}
+
+// The deque behind a mutex that ts_queue used to be, for comparison
+static std::deque<uint32_t> lockedQueue;
+static pthread_mutex_t lockedMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lockedNotEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lockedNotFull = PTHREAD_COND_INITIALIZER;
+
+static void *locked_producer_thread(void *arg) {
+  unsigned items = *(unsigned*)arg;
+  for (unsigned i = 1; i <= items + 1; ++i) {
+    pthread_mutex_lock(&lockedMutex);
+    while (lockedQueue.size() >= QUEUE_SIZE)
+      pthread_cond_wait(&lockedNotFull, &lockedMutex);
+    lockedQueue.push_back(i > items ? DONE : i);
+    pthread_mutex_unlock(&lockedMutex);
+    pthread_cond_signal(&lockedNotEmpty);
+  }
+  return NULL;
+}
+
+static void *locked_consumer_thread(void *) {
+  while (true) {
+    pthread_mutex_lock(&lockedMutex);
+    while (lockedQueue.empty())
+      pthread_cond_wait(&lockedNotEmpty, &lockedMutex);
+    uint32_t item = lockedQueue.front();
+    lockedQueue.pop_front();
+    pthread_mutex_unlock(&lockedMutex);
+    pthread_cond_signal(&lockedNotFull);
+    if (item == DONE) return NULL;
+  }
+}
+
+static double runLocked(unsigned threads, unsigned items) {
+  pthread_t ids[2 * MAX_THREADS];
+  double start = now();
+  for (unsigned i = 0; i < threads; ++i) {
+    pthread_create(&ids[i], NULL, locked_producer_thread, &items);
+    pthread_create(&ids[threads + i], NULL, locked_consumer_thread, NULL);
+  }
+  for (unsigned i = 0; i < 2 * threads; ++i)
+    pthread_join(ids[i], NULL);
+  return (double)threads * items / (now() - start);
+}
+
+static void testTimedWaits() {
+  ts_queue<int, 4> q;
+  int item;
+
+  double start = now();
+  check(!q.pop_front(item, 100), "pop from empty queue times out");
+  double elapsed = now() - start;
+  check(elapsed >= 0.09 && elapsed < 1.0, "pop timeout is about 100ms");
+
+  check(!q.try_pop_front(item), "try_pop on empty queue");
+  for (int i = 0; i < 4; ++i)
+    check(q.try_push_back(i), "try_push while not full");
+  check(!q.try_push_back(4), "try_push on full queue");
+  start = now();
+  check(!q.push_back(4, 50), "push to full queue times out");
+  elapsed = now() - start;
+  check(elapsed >= 0.04 && elapsed < 1.0, "push timeout is about 50ms");
+  check(q.size() == 4, "size of full queue");
+
+  int batch[8];
+  check(q.try_pop_front_n(batch, 8) == 4, "batch pop takes what's there");
+  for (int i = 0; i < 4; ++i)
+    check(batch[i] == i, "batch pop in order");
+  int more[6] = { 10, 11, 12, 13, 14, 15 };
+  check(q.try_push_back_n(more, 6) == 4, "batch push fills the queue");
+  check(q.clear() == 4, "clear empties the queue");
+  check(q.pop_front(item, 0) == false, "zero timeout doesn't wait");
+}
+
+typedef ts_spsc_ring<uint32_t, 16> ring_t;
+
+struct ring_run_t {
+  ring_t* ring;
+  unsigned items;
+};
+
+static void *ring_producer_thread(void *arg) {
+  ring_run_t* run = (ring_run_t*)arg;
+  ring_t* ring = run->ring;
+  for (uint32_t i = 1; i <= run->items; ++i) {
+    uint32_t* slot;
+    while ((slot = ring->back_slot()) == NULL)
+      sched_yield();
+    *slot = i;
+    ring->push_back_slot();
+  }
+  return NULL;
+}
+
+// One producer and one consumer through the ring, returning items per second
+static double runRing(unsigned items) {
+  ring_t ring;
+  ring_run_t run = { &ring, items };
+  pthread_t producer;
+  bool ordered = true;
+
+  uint32_t* slot = ring.front_slot();
+  check(slot == NULL && ring.empty(), "new ring is empty");
+  double start = now();
+  pthread_create(&producer, NULL, ring_producer_thread, &run);
+  uint32_t expect = 1;
+  while (expect <= items) {
+    if ((slot = ring.front_slot()) == NULL) {
+      sched_yield();
+      continue;
+    }
+    if (*slot != expect) ordered = false;
+    ++expect;
+    ring.pop_front_slot();
+  }
+  pthread_join(producer, NULL);
+  double elapsed = now() - start;
+  check(ordered, "ring items in order");
+  check(ring.empty(), "ring empty after run");
+
+  for (uint32_t i = 0; i < 16; ++i) {
+    slot = ring.back_slot();
+    check(slot != NULL, "ring has room until full");
+    if (slot) *slot = i;
+    ring.push_back_slot();
+  }
+  check(ring.back_slot() == NULL, "full ring has no back slot");
+  for (uint32_t i = 0; i < 16; ++i) {
+    slot = ring.front_slot();
+    check(slot != NULL && *slot == i, "ring pops in order");
+    ring.pop_front_slot();
+  }
+  check(ring.front_slot() == NULL, "ring empty again");
+  return items / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned items = argc > 1 ? atoi(argv[1]) : 200000;
+  if (items < 1 || items > 0xffffff) items = 200000;
+
+  testTimedWaits();
+
+  static const unsigned configs[][2] = { {1, 1}, {1, 4}, {4, 1}, {4, 4}, {8, 8} };
+  static const unsigned batches[] = { 1, 16 };
+  printf("%-24s %8s %14s\n", "producers x consumers", "batch", "items/s");
+  for (unsigned b = 0; b < sizeof(batches) / sizeof(batches[0]); ++b) {
+    for (unsigned c = 0; c < sizeof(configs) / sizeof(configs[0]); ++c) {
+      double rate = runQueue(configs[c][0], configs[c][1], items, batches[b]);
+      printf("%10u x %-11u %8u %14.0f\n", configs[c][0], configs[c][1], batches[b], rate);
+    }
+  }
+  for (unsigned threads = 1; threads <= 4; threads *= 4)
+    printf("%10u x %-11u %8s %14.0f\n", threads, threads, "mutex", runLocked(threads, items));
+  printf("%10u x %-11u %8s %14.0f\n", 1, 1, "spsc", runRing(items));
+
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
   }
+  printf("All checks passed\n");
+  return 0;
 }
@@ -0,0 +1,140 @@
+#include "sha2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Checks each SHA-256 kernel the CPU supports against the portable one
+// on random messages, and reports merkle pair hashes/s for each.
+// Usage: testsha2 [messages]
+
+#define MAX_LEN 300
+#define MAX_COUNT 20
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static const struct
+{
+  unsigned int features;
+  const char* name;
+} kernels[] = {
+  { 0, "portable" },
+  { SHA256_SHANI, "SHA-NI" },
+  { SHA256_ARMV8, "ARMv8" },
+  { SHA256_AVX2, "AVX2 x8" },
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, const char* kernel, unsigned len)
+{
+  if (!ok)
+  {
+    printf("FAIL: %s with %s, %u bytes\n", what, kernel, len);
+    failures++;
+  }
+}
+
+// Hashes in random sized pieces, to go through every path in sha256_update
+static void hashPieces(const unsigned char* message, unsigned len, unsigned char* digest)
+{
+  sha256_ctx ctx;
+  sha256_init(&ctx);
+  for (unsigned done = 0; done < len; )
+  {
+    unsigned piece = rand() % (len - done + 1);
+    sha256_update(&ctx, message + done, piece);
+    done += piece;
+  }
+  sha256_final(&ctx, digest);
+}
+
+int main(int argc, char* argv[])
+{
+  int messages = argc > 1 ? atoi(argv[1]) : 2000;
+  if (messages < 1) messages = 2000;
+
+  unsigned int supported = sha256_features();
+  unsigned char digest[32];
+
+  // The portable kernel against a FIPS 180-2 vector first
+  static const unsigned char abc[32] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad };
+  sha256_use(0);
+  sha256((const unsigned char*)"abc", 3, digest);
+  check(memcmp(digest, abc, 32) == 0, "FIPS vector", "portable", 3);
+
+  static unsigned char data[MAX_COUNT * (MAX_LEN + 64)];
+  static unsigned char expected[MAX_COUNT * 32], actual[MAX_COUNT * 32];
+  for (unsigned k = 1; k < sizeof(kernels) / sizeof(kernels[0]); ++k)
+  {
+    if (!(supported & kernels[k].features))
+    {
+      printf("%-10s not supported\n", kernels[k].name);
+      continue;
+    }
+    srand(k);
+    for (int m = 0; m < messages; ++m)
+    {
+      unsigned len = rand() % (MAX_LEN + 1);
+      unsigned count = 1 + rand() % MAX_COUNT;
+      unsigned stride = len + rand() % 64;
+      for (unsigned i = 0; i < count * stride; ++i) data[i] = rand();
+
+      sha256_use(0);
+      for (unsigned i = 0; i < count; ++i)
+        sha256(data + i * stride, len, expected + i * 32);
+
+      sha256_use(kernels[k].features);
+      hashPieces(data, len, actual);
+      check(memcmp(expected, actual, 32) == 0, "sha256_update", kernels[k].name, len);
+      sha256_x8(data, stride, len, count, actual);
+      check(memcmp(expected, actual, count * 32) == 0, "sha256_x8", kernels[k].name, len);
+    }
+  }
+
+  // Double SHA-256 of 64 byte pairs, as for a merkle tree layer
+  const unsigned pairs = 4096;
+  static unsigned char layer[pairs * 64], hashes[pairs * 32], next[pairs * 32];
+  for (unsigned i = 0; i < sizeof(layer); ++i) layer[i] = rand();
+  printf("%-10s %14s %14s\n", "kernel", "pairs/s", "pairs/s x8");
+  for (unsigned k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k)
+  {
+    if (kernels[k].features && !(supported & kernels[k].features))
+      continue;
+    sha256_use(kernels[k].features);
+
+    double start = now();
+    for (int r = 0; r < 20; ++r)
+      for (unsigned i = 0; i < pairs; ++i)
+      {
+        sha256(layer + i * 64, 64, hashes + i * 32);
+        sha256(hashes + i * 32, 32, next + i * 32);
+      }
+    double single = 20 * pairs / (now() - start);
+
+    start = now();
+    for (int r = 0; r < 20; ++r)
+    {
+      sha256_x8(layer, 64, 64, pairs, hashes);
+      sha256_x8(hashes, 32, 32, pairs, next);
+    }
+    double batched = 20 * pairs / (now() - start);
+
+    printf("%-10s %14.0f %14.0f\n", kernels[k].name, single, batched);
+  }
+
+  if (failures)
+  {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
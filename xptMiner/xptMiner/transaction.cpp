@@ -27,34 +27,38 @@ void bitclient_addVarIntFromStream(stream_t* msgStream, uint64 varInt)
 	}
 }
 
-void bitclient_generateTxHash(uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase1Length, uint8* coinBase1, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash, uint32 mode)
+/*
+ * Hashes the part of the coinbase before the extra nonce, which stays the same for a work update
+ */
+void bitclient_prepareCoinBase(sha256_ctx* coinBase1State, uint32 coinBase1Length, uint8* coinBase1)
 {
-	stream_t* streamTXData = streamEx_fromDynamicMemoryRange(1024*32);
-	stream_writeData(streamTXData, coinBase1, coinBase1Length);
-	stream_writeData(streamTXData, userExtraNonce, userExtraNonceLength);
-	stream_writeData(streamTXData, coinBase2, coinBase2Length);
-	sint32 transactionDataLength = 0;
-	uint8* transactionData = (uint8*)streamEx_map(streamTXData, &transactionDataLength);
-	// special case, we can use the hash of the transaction
-	uint8 hashOut[32];
-	sha256_ctx sctx;
+	sha256_init(coinBase1State);
+	sha256_update(coinBase1State, coinBase1, coinBase1Length);
+}
+
+/*
+ * Finishes the coinbase hash from the state left by bitclient_prepareCoinBase(), without allocating
+ */
+void bitclient_generateTxHashFromState(sha256_ctx* coinBase1State, uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash, uint32 mode)
+{
+	sha256_ctx sctx = *coinBase1State;
+	sha256_update(&sctx, userExtraNonce, userExtraNonceLength);
+	sha256_update(&sctx, coinBase2, coinBase2Length);
 	if( mode == TX_MODE_DOUBLE_SHA256 )
 	{
-		sha256_init(&sctx);
-		sha256_update(&sctx, transactionData, transactionDataLength);
+		uint8 hashOut[32];
 		sha256_final(&sctx, hashOut);
 		sha256_init(&sctx);
 		sha256_update(&sctx, hashOut, 32);
-		sha256_final(&sctx, txHash);
 	}
-	else
-	{
-		sha256_init(&sctx);
-		sha256_update(&sctx, transactionData, transactionDataLength);
-		sha256_final(&sctx, txHash);
-	}
-	free(transactionData);
-	stream_destroy(streamTXData);
+	sha256_final(&sctx, txHash);
+}
+
+void bitclient_generateTxHash(uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase1Length, uint8* coinBase1, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash, uint32 mode)
+{
+	sha256_ctx coinBase1State;
+	bitclient_prepareCoinBase(&coinBase1State, coinBase1Length, coinBase1);
+	bitclient_generateTxHashFromState(&coinBase1State, userExtraNonceLength, userExtraNonce, coinBase2Length, coinBase2, txHash, mode);
 }
 
 void bitclient_calculateMerkleRoot(uint8* txHashes, uint32 numberOfTxHashes, uint8* merkleRoot, uint32 mode)
@@ -92,7 +96,7 @@ void bitclient_calculateMerkleRoot(uint8* txHashes, uint32 numberOfTxHashes, uin
 			layerSize[0]++;
 		}
 		// process layers
-		for(uint32 f=0; f<10; f++)
+		for(uint32 f=0; f<15; f++)
 		{
 			if( layerSize[f] == 0 )
 			{
@@ -141,4 +145,85 @@ void bitclient_calculateMerkleRoot(uint8* txHashes, uint32 numberOfTxHashes, uin
 		}
 		free(hashData);
 	}
-}
\ No newline at end of file
+}
+
+/*
+ * Hashes two 32 byte hashes, left then right, into hashOut
+ */
+static void bitclient_hashPair(uint8* left, uint8* right, uint8* hashOut, uint32 mode)
+{
+	sha256_ctx sha256_ctx;
+	sha256_init(&sha256_ctx);
+	sha256_update(&sha256_ctx, left, 32);
+	sha256_update(&sha256_ctx, right, 32);
+	if( mode == TX_MODE_DOUBLE_SHA256 )
+	{
+		uint8 hashTemp[32];
+		sha256_final(&sha256_ctx, hashTemp);
+		sha256_init(&sha256_ctx);
+		sha256_update(&sha256_ctx, hashTemp, 32);
+	}
+	sha256_final(&sha256_ctx, hashOut);
+}
+
+/*
+ * Hashes count consecutive pairs of 32 byte hashes into hashOut, eight at a time where that is faster.
+ * hashOut may be the same memory as pairs, or behind it
+ */
+static void bitclient_hashPairs(uint8* pairs, uint32 count, uint8* hashOut, uint32 mode)
+{
+	uint8 hashTemp[32*8];
+	for(uint32 i=0; i<count; i+=8)
+	{
+		uint32 n = count-i < 8 ? count-i : 8;
+		if( mode == TX_MODE_DOUBLE_SHA256 )
+		{
+			sha256_x8(pairs+64*i, 64, 64, n, hashTemp);
+			sha256_x8(hashTemp, 32, 32, n, hashOut+32*i);
+		}
+		else
+			sha256_x8(pairs+64*i, 64, 64, n, hashOut+32*i);
+	}
+}
+
+/*
+ * Calculates the merkle branch of the coinbase, the hashes it is paired with on the way to the root.
+ * txHashes starts with the coinbase, whose hash isn't needed, and is used as scratch space.
+ * Returns the number of hashes written to merkleBranch, at most MAX_MERKLE_BRANCH
+ */
+uint32 bitclient_calculateMerkleBranch(uint8* txHashes, uint32 numberOfTxHashes, uint8* merkleBranch, uint32 mode)
+{
+	if( numberOfTxHashes > (1<<MAX_MERKLE_BRANCH) )
+	{
+		printf("bitclient_calculateMerkleBranch: Too many transactions\n");
+		return 0;
+	}
+	uint32 branchLength = 0;
+	uint32 layerSize = numberOfTxHashes;
+	while( layerSize > 1 )
+	{
+		memcpy(merkleBranch+branchLength*32, txHashes+32, 32);
+		branchLength++;
+		// pair up the rest of the layer in place, the last hash is paired with itself if it is on its own
+		uint32 nextLayerSize = (layerSize+1)/2;
+		if( layerSize/2 > 1 )
+			bitclient_hashPairs(txHashes+64, layerSize/2-1, txHashes+32, mode);
+		if( layerSize&1 && nextLayerSize > 1 )
+		{
+			uint8* last = txHashes+64*(nextLayerSize-1);
+			bitclient_hashPair(last, last, txHashes+32*(nextLayerSize-1), mode);
+		}
+		layerSize = nextLayerSize;
+	}
+	return branchLength;
+}
+
+/*
+ * Calculates the merkle root for a coinbase from the branch found by bitclient_calculateMerkleBranch()
+ */
+void bitclient_calculateMerkleRootFromBranch(uint8* coinbaseHash, uint8* merkleBranch, uint32 branchLength, uint8* merkleRoot, uint32 mode)
+{
+	memcpy(merkleRoot, coinbaseHash, 32);
+	for(uint32 i=0; i<branchLength; i++)
+		bitclient_hashPair(merkleRoot, merkleBranch+i*32, merkleRoot, mode);
+}
@@ -1,8 +1,14 @@
 
 void bitclient_generateTxHash(uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase1Length, uint8* coinBase1, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash, uint32 mode);
+void bitclient_prepareCoinBase(sha256_ctx* coinBase1State, uint32 coinBase1Length, uint8* coinBase1);
+void bitclient_generateTxHashFromState(sha256_ctx* coinBase1State, uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash, uint32 mode);
 void bitclient_calculateMerkleRoot(uint8* txHashes, uint32 numberOfTxHashes, uint8* merkleRoot, uint32 mode);
+uint32 bitclient_calculateMerkleBranch(uint8* txHashes, uint32 numberOfTxHashes, uint8* merkleBranch, uint32 mode);
+void bitclient_calculateMerkleRootFromBranch(uint8* coinbaseHash, uint8* merkleBranch, uint32 branchLength, uint8* merkleRoot, uint32 mode);
 // misc
 void bitclient_addVarIntFromStream(stream_t* msgStream, uint64 varInt);
 
 #define TX_MODE_DOUBLE_SHA256	(0)
-#define TX_MODE_SINGLE_SHA256	(1)
\ No newline at end of file
+#define TX_MODE_SINGLE_SHA256	(1)
+
+#define MAX_MERKLE_BRANCH		(16)	// hashes in a merkle branch, enough for 2^16 transactions
\ No newline at end of file
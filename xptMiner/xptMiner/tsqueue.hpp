@@ -1,7 +1,18 @@
 /*
- * Threadsafe blocking work queue implementation
+ * Threadsafe bounded work queue implementation
  * Defined to be analogous to STL deque;  please follow STL
  * naming conventions for methods.
+ *
+ * A lock-free multi producer, multi consumer ring after Dmitry Vyukov's
+ * bounded queue.  Each cell carries a sequence number saying whether it
+ * is free or full on the current lap, so a producer only contends with
+ * other producers on the tail index and a consumer with other consumers
+ * on the head, and a batch of n items moves with one compare and swap.
+ * Threads that have to block spin briefly first, then sleep on a futex
+ * (a condition variable off Linux).  They are only woken when they've
+ * said they're waiting and the queue has just stopped being empty (or
+ * full), and a woken thread passes the wake on if there's more for
+ * another, so most pushes and pops make no system call.
  */
 
 #ifndef _TSQUEUE_H_
@@ -9,77 +20,377 @@
 
 #include "global.h" /* Provides CRITICAL_SECTION */
 
-#include <deque>
+#include <atomic>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-template<class T, int maxSize>
-class ts_queue {
+#define TS_QUEUE_CACHE_LINE 64
+#define TS_QUEUE_SPINS 200 /* attempts before a blocking call sleeps */
+
+static inline void ts_queue_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__ ("yield");
+#endif
+}
+
+/*
+ * Event count: a waiter reads the count, checks its condition, then
+ * sleeps only if nothing has been signalled since it read the count.
+ */
+class ts_event {
 private:
-  std::deque<T> _q;
+  std::atomic<uint32_t> _count;
+  std::atomic<uint32_t> _waiters;
+#ifndef __linux__
   CRITICAL_SECTION _m;
   CONDITION_VARIABLE _cv;
-  CONDITION_VARIABLE _cv_full;
+#endif
 
 public:
-  ts_queue() {
+  ts_event() : _count(0), _waiters(0) {
+#ifndef __linux__
     InitializeCriticalSection(&_m);
     InitializeConditionVariable(&_cv);
-    InitializeConditionVariable(&_cv_full);
+#endif
   }
 
-  /* Blocks iff queue size >= maxSize */
-  void push_back(T item) {
+  /* Call before checking the condition, then wait() or cancel() */
+  uint32_t prepare() {
+    _waiters.fetch_add(1, std::memory_order_seq_cst);
+    return _count.load(std::memory_order_seq_cst);
+  }
+
+  void cancel() {
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  /* Sleeps until signalled after prepare() returned seen, or for up to
+     ms milliseconds if ms >= 0.  Returns false on timeout. */
+  bool wait(uint32_t seen, int ms) {
+    bool signalled = true;
+#ifdef __linux__
+    struct timespec timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_nsec = (ms % 1000) * 1000000L;
+    if (_count.load(std::memory_order_acquire) == seen &&
+        syscall(SYS_futex, &_count, FUTEX_WAIT_PRIVATE, seen, ms >= 0 ? &timeout : NULL, NULL, 0) != 0)
+      signalled = errno != ETIMEDOUT;
+#else
     EnterCriticalSection(&_m);
-    while (_q.size() >= maxSize) {
-      SleepConditionVariableCS(&_cv_full, &_m, 2000);
+    if (_count.load(std::memory_order_acquire) == seen) {
+#ifdef _WIN32
+      signalled = SleepConditionVariableCS(&_cv, &_m, ms >= 0 ? ms : INFINITE) != 0;
+#else
+      if (ms < 0) {
+        pthread_cond_wait(&_cv, &_m);
+      } else {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ms / 1000;
+        deadline.tv_nsec += (ms % 1000) * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        signalled = pthread_cond_timedwait(&_cv, &_m, &deadline) == 0;
+      }
+#endif
     }
-    _q.push_back(item);
     LeaveCriticalSection(&_m);
-    WakeConditionVariable(&_cv);
+#endif
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+    return signalled;
   }
 
-  void push_front(T item) {
+  /* Wakes up to n waiters.  Costs only a fence if there are none: the
+     change being signalled is then visible to anyone who starts waiting. */
+  void signal(int n) {
+    if (waiting()) wake(n);
+  }
+
+  /* After a change, true if anyone may be waiting for it */
+  bool waiting() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return _waiters.load(std::memory_order_relaxed) != 0;
+  }
+
+  /* Wakes up to n waiters, once waiting() has said there may be some */
+  void wake(int n) {
+    _count.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+    syscall(SYS_futex, &_count, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
     EnterCriticalSection(&_m);
-    while (_q.size() >= maxSize) {
-      SleepConditionVariableCS(&_cv_full, &_m, 2000);
-    }
-    _q.push_front(item);
     LeaveCriticalSection(&_m);
-    WakeConditionVariable(&_cv);
+    if (n == 1) WakeConditionVariable(&_cv);
+    else WakeAllConditionVariable(&_cv);
+#endif
   }
+};
 
+/* Milliseconds left until deadline, from a CLOCK_MONOTONIC time */
+static inline int ts_queue_remaining(const struct timespec& deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+  return ms > 0 ? (int)ms : 0;
+}
+
+template<class T, int maxSize>
+class ts_queue {
+private:
+  struct cell_t {
+    std::atomic<size_t> seq;
+    T item;
+  };
+
+  /* Each index on its own cache line, away from the cells */
+  alignas(TS_QUEUE_CACHE_LINE) std::atomic<size_t> _tail;
+  alignas(TS_QUEUE_CACHE_LINE) std::atomic<size_t> _head;
+  alignas(TS_QUEUE_CACHE_LINE) cell_t _cells[maxSize];
+  ts_event _notEmpty;
+  ts_event _notFull;
+
+  /* Claims up to n free cells at the tail, returning how many and the first */
+  size_t claimPush(size_t n, size_t& first) {
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    while (true) {
+      size_t k = 0;
+      while (k < n && _cells[(pos + k) % maxSize].seq.load(std::memory_order_acquire) == pos + k)
+        ++k;
+      if (k == 0) {
+        /* Full, unless another producer has just moved the tail on */
+        size_t seq = _cells[pos % maxSize].seq.load(std::memory_order_acquire);
+        if ((ptrdiff_t)(seq - pos) < 0) return 0;
+        pos = _tail.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (_tail.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+        first = pos;
+        return k;
+      }
+    }
+  }
+
+  /* Claims up to n full cells at the head, returning how many and the first */
+  size_t claimPop(size_t n, size_t& first) {
+    size_t pos = _head.load(std::memory_order_relaxed);
+    while (true) {
+      size_t k = 0;
+      while (k < n && _cells[(pos + k) % maxSize].seq.load(std::memory_order_acquire) == pos + k + 1)
+        ++k;
+      if (k == 0) {
+        size_t seq = _cells[pos % maxSize].seq.load(std::memory_order_acquire);
+        if ((ptrdiff_t)(seq - (pos + 1)) < 0) return 0;
+        pos = _head.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (_head.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+        first = pos;
+        return k;
+      }
+    }
+  }
+
+  /* Only the push that makes the queue non-empty wakes a consumer */
+  void pushed(size_t first, size_t k) {
+    if (_notEmpty.waiting() &&
+        (ptrdiff_t)(_head.load(std::memory_order_relaxed) - first) >= 0)
+      _notEmpty.wake((int)k);
+  }
+
+  /* and only the pop that makes it non-full wakes a producer */
+  void popped(size_t first, size_t k) {
+    if (_notFull.waiting() &&
+        (ptrdiff_t)(_tail.load(std::memory_order_relaxed) - first - maxSize) >= 0)
+      _notFull.wake((int)k);
+  }
+
+  /* Waits on event until attempt() succeeds or the time is up.  A thread
+     that was woken wakes another if more() says there's still something
+     for it, as pushes and pops after the first don't wake anyone. */
+  template<class F, class M>
+  bool waitFor(ts_event& event, int ms, F attempt, M more) {
+    for (int spin = 0; spin < TS_QUEUE_SPINS; ++spin) {
+      if (attempt()) return true;
+      if (ms == 0) return false;
+      ts_queue_relax();
+    }
+    struct timespec deadline;
+    if (ms > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += ms / 1000;
+      deadline.tv_nsec += (ms % 1000) * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+    }
+    bool woken = false;
+    while (true) {
+      if (attempt()) break;
+      uint32_t seen = event.prepare();
+      if (attempt()) {
+        event.cancel();
+        break;
+      }
+      int left = ms < 0 ? -1 : ts_queue_remaining(deadline);
+      if (left == 0) {
+        event.cancel();
+        return false;
+      }
+      event.wait(seen, left);
+      woken = true;
+    }
+    if (woken && more()) event.signal(1);
+    return true;
+  }
+
+  bool notEmpty() { return size() > 0; }
+  bool notFull() { return size() < maxSize; }
+
+public:
+  ts_queue() : _tail(0), _head(0) {
+    for (size_t i = 0; i < (size_t)maxSize; ++i)
+      _cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  /* Nonblocking - pushes as many of the n items as fit, returns how many */
+  size_t try_push_back_n(const T* items, size_t n) {
+    size_t first, k = claimPush(n, first);
+    for (size_t i = 0; i < k; ++i) {
+      cell_t& cell = _cells[(first + i) % maxSize];
+      cell.item = items[i];
+      cell.seq.store(first + i + 1, std::memory_order_release);
+    }
+    if (k) pushed(first, k);
+    return k;
+  }
+
+  /* Nonblocking - pops up to n items, returns how many */
+  size_t try_pop_front_n(T* items, size_t n) {
+    size_t first, k = claimPop(n, first);
+    for (size_t i = 0; i < k; ++i) {
+      cell_t& cell = _cells[(first + i) % maxSize];
+      items[i] = cell.item;
+      cell.seq.store(first + i + maxSize, std::memory_order_release);
+    }
+    if (k) popped(first, k);
+    return k;
+  }
+
+  bool try_push_back(const T& item) {
+    return try_push_back_n(&item, 1) == 1;
+  }
+
+  /* Nonblocking - returns false if there was no item to pop */
+  bool try_pop_front(T& item) {
+    return try_pop_front_n(&item, 1) == 1;
+  }
+
+  /* Waits up to ms milliseconds (forever if negative) for room, returns false on timeout */
+  bool push_back(const T& item, int ms) {
+    return waitFor(_notFull, ms, [&]() { return try_push_back(item); }, [&]() { return notFull(); });
+  }
+
+  /* Waits up to ms milliseconds (forever if negative) for an item, returns false on timeout */
+  bool pop_front(T& item, int ms) {
+    return waitFor(_notEmpty, ms, [&]() { return try_pop_front(item); }, [&]() { return notEmpty(); });
+  }
+
+  /* Blocks iff queue size >= maxSize */
+  void push_back(const T& item) {
+    push_back(item, -1);
+  }
 
   /* Blocks until an item is available to pop */
   T pop_front() {
-    EnterCriticalSection(&_m);
-    while (_q.empty()) {
-      SleepConditionVariableCS(&_cv, &_m, 2000);
-    }
-    /* Pop and notify sleeping inserters */
-    auto r = _q.front();
-    _q.pop_front();
-    LeaveCriticalSection(&_m);
-    WakeConditionVariable(&_cv_full);
-    return r;
+    T item;
+    pop_front(item, -1);
+    return item;
   }
-  
+
+  /* Blocks until all n items are pushed */
+  void push_back_n(const T* items, size_t n) {
+    size_t done = 0;
+    waitFor(_notFull, -1, [&]() {
+      done += try_push_back_n(items + done, n - done);
+      return done == n;
+    }, [&]() { return notFull(); });
+  }
+
+  /* Blocks until there is at least one item, then pops up to n, returns how many */
+  size_t pop_front_n(T* items, size_t n) {
+    size_t k = 0;
+    waitFor(_notEmpty, -1, [&]() { return (k = try_pop_front_n(items, n)) > 0; }, [&]() { return notEmpty(); });
+    return k;
+  }
+
   /* Nonblocking - clears queue, returns number of items removed */
-  typename std::deque<T>::size_type clear() {
-    EnterCriticalSection(&_m);
-    auto s = _q.size();
-    _q.clear();
-    //while (!_q.empty()) {
-    //_q.pop();
-    //}
-    LeaveCriticalSection(&_m);
-    WakeAllConditionVariable(&_cv_full);
-    return s;
+  size_t clear() {
+    T items[16];
+    size_t total = 0, k;
+    while ((k = try_pop_front_n(items, 16)) > 0)
+      total += k;
+    return total;
   }
 
+  /* Only a snapshot while other threads are using the queue */
   int size() {
-    EnterCriticalSection(&_m);
-    auto s = _q.size();
-    LeaveCriticalSection(&_m);
-    return s;
+    size_t head = _head.load(std::memory_order_acquire);
+    size_t tail = _tail.load(std::memory_order_acquire);
+    return tail > head ? (int)(tail - head) : 0;
+  }
+
+};
+
+/*
+ * Single producer, single consumer ring of preallocated items.  The
+ * producer fills the item at the back in place and then publishes it,
+ * and the consumer reads the front in place before releasing it, so
+ * nothing is copied or allocated and neither side ever waits.
+ */
+template<class T, int maxSize>
+class ts_spsc_ring {
+private:
+  alignas(TS_QUEUE_CACHE_LINE) std::atomic<size_t> _tail;
+  alignas(TS_QUEUE_CACHE_LINE) std::atomic<size_t> _head;
+  alignas(TS_QUEUE_CACHE_LINE) T _items[maxSize];
+
+public:
+  ts_spsc_ring() : _tail(0), _head(0) {}
+
+  /* Producer only - the item to fill for the next push, NULL if full */
+  T* back_slot() {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == (size_t)maxSize) return NULL;
+    return &_items[tail % maxSize];
+  }
+
+  /* Producer only - publishes the item back_slot() returned */
+  void push_back_slot() {
+    _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /* Consumer only - the oldest item, NULL if empty */
+  T* front_slot() {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) return NULL;
+    return &_items[head % maxSize];
+  }
+
+  /* Consumer only - hands the item front_slot() returned back to the producer */
+  void pop_front_slot() {
+    _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  bool empty() {
+    return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
   }
 
 };
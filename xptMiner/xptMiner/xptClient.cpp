@@ -55,9 +55,7 @@ xptClient_t* xptClient_create()
 	xptClient->clientSocket = SOCKET_ERROR;
 	xptClient->sendBuffer = xptPacketbuffer_create(256*1024);
 	xptClient->recvBuffer = xptPacketbuffer_create(256*1024);
-	InitializeCriticalSection(&xptClient->cs_shareSubmit);
 	InitializeCriticalSection(&xptClient->cs_workAccess);
-	xptClient->list_shareSubmitQueue = simpleList_create(4);
 	// return object
 	return xptClient;
 }
@@ -137,7 +135,6 @@ void xptClient_free(xptClient_t* xptClient)
 	{
 		closesocket(xptClient->clientSocket);
 	}
-	simpleList_free(xptClient->list_shareSubmitQueue);
 	free(xptClient);
 }
 
@@ -391,6 +388,18 @@ void xptClient_sendWorkerLogin(xptClient_t* xptClient)
 	send(xptClient->clientSocket, (const char*)(xptClient->sendBuffer->buffer), xptClient->sendBuffer->parserIndex, 0);
 }
 
+/*
+ * Converts a getTimeHighRes() interval to milliseconds
+ */
+double xptClient_highResToMs(uint64 ticks)
+{
+#ifdef _WIN32
+	return (double)ticks * 1000.0 / (double)getTimerRes();
+#else
+	return (double)ticks / 1000000.0;
+#endif
+}
+
 /*
  * Sends the share packet
  */
@@ -475,20 +484,6 @@ bool xptClient_process(xptClient_t* xptClient)
 {
 	if( xptClient == NULL )
 		return false;
-	// are there shares to submit?
-	EnterCriticalSection(&xptClient->cs_shareSubmit);
-	if( xptClient->list_shareSubmitQueue->objectCount > 0 )
-	{
-		for(uint32 i=0; i<xptClient->list_shareSubmitQueue->objectCount; i++)
-		{
-			xptShareToSubmit_t* xptShareToSubmit = (xptShareToSubmit_t*)xptClient->list_shareSubmitQueue->objects[i];
-			xptClient_sendShare(xptClient, xptShareToSubmit);
-			free(xptShareToSubmit);
-		}
-		// clear list
-		xptClient->list_shareSubmitQueue->objectCount = 0;
-	}
-	LeaveCriticalSection(&xptClient->cs_shareSubmit);
 	// check if we need to send ping
 	uint32 currentTime = (uint32)time(NULL);
 	if( xptClient->time_sendPing != 0 && currentTime >= xptClient->time_sendPing )
@@ -588,9 +583,3 @@ bool xptClient_isAuthenticated(xptClient_t* xptClient)
 	return (xptClient->clientState == XPT_CLIENT_STATE_LOGGED_IN);
 }
 
-void xptClient_foundShare(xptClient_t* xptClient, xptShareToSubmit_t* xptShareToSubmit)
-{
-	EnterCriticalSection(&xptClient->cs_shareSubmit);
-	simpleList_add(xptClient->list_shareSubmitQueue, xptShareToSubmit);
-	LeaveCriticalSection(&xptClient->cs_shareSubmit);
-}
@@ -25,6 +25,11 @@ typedef struct
 	uint8 merkleRootOriginal[32];
 	uint32 userExtraNonceLength;
 	uint8 userExtraNonceData[16];
+	// block solutions skip ahead of queued shares, times are from getTimeHighRes()
+	bool isBlock;
+	uint64 timeFound;
+	uint64 timeQueued;
+	uint32 height; // for the log
 }xptShareToSubmit_t;
 
 typedef struct  
@@ -54,9 +59,6 @@ typedef struct
 	xptBlockWorkInfo_t blockWorkInfo;
 	bool hasWorkData;
 	float earnedShareValue; // this value is sent by the server with each new block that is sent
-	// shares to submit
-	CRITICAL_SECTION cs_shareSubmit;
-	simpleList_t* list_shareSubmitQueue;
 	// timers
 	uint32 time_sendPing;
 	uint64 pingSum;
@@ -77,7 +79,7 @@ void xptClient_forceDisconnect(xptClient_t* xptClient);
 bool xptClient_process(xptClient_t* xptClient); // needs to be called in a loop
 bool xptClient_isDisconnected(xptClient_t* xptClient, char** reason);
 bool xptClient_isAuthenticated(xptClient_t* xptClient);
-void xptClient_foundShare(xptClient_t* xptClient, xptShareToSubmit_t* xptShareToSubmit);
+void xptClient_sendShare(xptClient_t* xptClient, xptShareToSubmit_t* xptShareToSubmit); // from the thread calling xptClient_process only
 
 // never send this directly
 void xptClient_sendWorkerLogin(xptClient_t* xptClient);
@@ -91,6 +93,7 @@ bool xptClient_processPacket_ping(xptClient_t* xptClient);
 
 // util
 void xptClient_getDifficultyTargetFromCompact(uint32 nCompact, uint32* hashTarget);
+double xptClient_highResToMs(uint64 ticks);
 
 // miner version string (needs to be defined somewhere in the project, max 45 characters)
 extern char* minerVersionString;
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include"global.h"
 #include"ticker.h"
+#include"rh_stats.h"
 
 /*
  * Called when a packet with the opcode XPT_OPC_S_AUTH_ACK is received
@@ -124,7 +125,7 @@ bool xptClient_processPacket_shareAck(xptClient_t* xptClient)
 		printf("Invalid share\n");
 		if( rejectReason[0] != '\0' )
 			printf("Reason: %s\n", rejectReason);
-		totalRejectedShareCount++;
+		rh_statsInc(RH_STAT_REJECTED);
 	}
 	return true;
 }